@@ -0,0 +1,73 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator for short-lived shading objects. Allocation is a pointer
+// increment; reset() releases everything at once but keeps the blocks, so
+// after the first few samples a render thread stops calling malloc.
+class arena {
+public:
+    explicit arena(size_t block_size = 16 * 1024) : block_size(block_size) {}
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+    ~arena() {
+        for (auto& b : blocks)
+            std::free(b.data);
+    }
+
+    void* allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+        while (current < blocks.size()) {
+            block& b = blocks[current];
+            size_t start = (offset + align - 1) & ~(align - 1);
+            if (start + bytes <= b.size) {
+                offset = start + bytes;
+                return b.data + start;
+            }
+            current++;
+            offset = 0;
+        }
+        size_t size = bytes + align > block_size ? bytes + align : block_size;
+        char* data = static_cast<char*>(std::malloc(size));
+        if (!data)
+            throw std::bad_alloc();
+        blocks.push_back(block{ data, size });
+        current = blocks.size() - 1;
+        offset = 0;
+        return allocate(bytes, align);
+    }
+
+    // Objects are never destroyed individually, so only trivially
+    // destructible types may live in the arena.
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        static_assert(std::is_trivially_destructible<T>::value,
+            "arena objects are released without running destructors");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    void reset() {
+        current = 0;
+        offset = 0;
+    }
+
+private:
+    struct block {
+        char* data;
+        size_t size;
+    };
+    std::vector<block> blocks;
+    size_t current = 0;
+    size_t offset = 0;
+    size_t block_size;
+};
+
+// Per-thread arena for objects that live for one camera sample. The render
+// loop resets it after every sample.
+inline arena& thread_arena() {
+    thread_local arena a;
+    return a;
+}
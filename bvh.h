@@ -1,100 +1,695 @@
 #pragma once
 #include "hittable_List.h"
+#include "primitives.h"
+#include "thread_pool.h"
 #include <algorithm>
 #include "rtweekend.h"
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
-    aabb box_a;
-    aabb box_b;
+#include <cmath>
+#include <cstdint>
+#include <limits>
 
-    if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+// Binned SAH construction. Every primitive's bounds and centroid are
+// computed once up front; each split then bins the centroids along all
+// three axes and keeps the cheapest plane under the surface area
+// heuristic, so a level costs O(n) instead of a full sort.
+//
+// Given a thread_pool, large ranges are binned in parallel chunks and the
+// two halves of a split are built as separate tasks.
+const int sah_bin_count = 16;
+const size_t bvh_max_leaf_size = 4;
+const double sah_traversal_cost = 0.125;
+const double sah_intersect_cost = 1.0;
+const size_t bvh_parallel_threshold = 16 * 1024;
 
-    return box_a.min().at(axis) < box_b.min().at(axis);
+struct bvh_primitive {
+    aabb box;
+    vec3 centroid;
+    size_t index;   // position of the primitive in the caller's array
+};
+
+inline aabb empty_box() {
+    return aabb(vec3(infinity, infinity, infinity), vec3(-infinity, -infinity, -infinity));
+}
+
+// Splits [start, end) into chunks, runs fn(begin, end, partial) on each
+// (in parallel when a pool is given and the range is large) and merges the
+// partial results into one.
+template <typename T, typename Fn>
+T bvh_reduce(thread_pool* pool, size_t start, size_t end, Fn fn) {
+    size_t count = end - start;
+    if (!pool || count < bvh_parallel_threshold) {
+        T result;
+        fn(start, end, result);
+        return result;
+    }
+    size_t chunks = pool->size() * 4;
+    std::vector<T> partial(chunks);
+    pool->parallel_for(chunks, [&](size_t c) {
+        fn(start + count * c / chunks, start + count * (c + 1) / chunks, partial[c]);
+    });
+    for (size_t c = 1; c < chunks; c++)
+        partial[0].merge(partial[c]);
+    return partial[0];
 }
 
+struct bvh_range_bounds {
+    aabb bounds = empty_box();
+    aabb centroid_bounds = empty_box();
+    void merge(const bvh_range_bounds& o) {
+        bounds = surrounding_box(bounds, o.bounds);
+        centroid_bounds = surrounding_box(centroid_bounds, o.centroid_bounds);
+    }
+};
+
+struct sah_bins {
+    aabb box[3][sah_bin_count];
+    size_t count[3][sah_bin_count];
+    sah_bins() {
+        for (int a = 0; a < 3; a++)
+            for (int b = 0; b < sah_bin_count; b++) {
+                box[a][b] = empty_box();
+                count[a][b] = 0;
+            }
+    }
+    void merge(const sah_bins& o) {
+        for (int a = 0; a < 3; a++)
+            for (int b = 0; b < sah_bin_count; b++) {
+                box[a][b] = surrounding_box(box[a][b], o.box[a][b]);
+                count[a][b] += o.count[a][b];
+            }
+    }
+};
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 0);
+inline int sah_bin(double c, double lo, double k) {
+    return std::max(0, std::min(sah_bin_count - 1, int((c - lo) * k)));
 }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 1);
+inline bvh_range_bounds range_bounds(const std::vector<bvh_primitive>& prims,
+    size_t start, size_t end, thread_pool* pool) {
+    return bvh_reduce<bvh_range_bounds>(pool, start, end,
+        [&](size_t b, size_t e, bvh_range_bounds& r) {
+            for (size_t i = b; i < e; i++) {
+                r.bounds = surrounding_box(r.bounds, prims[i].box);
+                r.centroid_bounds = surrounding_box(r.centroid_bounds, aabb(prims[i].centroid, prims[i].centroid));
+            }
+        });
 }
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 2);
+// Partitions prims[start, end) at the best SAH plane and returns the first
+// index of the right half, or `start` when a leaf is cheaper than any split.
+// `axis` receives the split axis.
+inline size_t sah_partition(std::vector<bvh_primitive>& prims, size_t start, size_t end,
+    const bvh_range_bounds& range, int& axis, thread_pool* pool = nullptr) {
+    axis = 0;
+    size_t count = end - start;
+    if (count <= 1)
+        return start;
+
+    const aabb& cb = range.centroid_bounds;
+    double lo[3], k[3];
+    for (int a = 0; a < 3; a++) {
+        lo[a] = cb.min()[a];
+        double extent = cb.max()[a] - lo[a];
+        k[a] = extent > 0 ? sah_bin_count / extent : 0;
+    }
+    sah_bins bins = bvh_reduce<sah_bins>(pool, start, end,
+        [&](size_t b, size_t e, sah_bins& bins) {
+            for (size_t i = b; i < e; i++)
+                for (int a = 0; a < 3; a++) {
+                    int bin = sah_bin(prims[i].centroid[a], lo[a], k[a]);
+                    bins.count[a][bin]++;
+                    bins.box[a][bin] = surrounding_box(bins.box[a][bin], prims[i].box);
+                }
+        });
+
+    int best_axis = -1;
+    int best_bin = 0;
+    double best_cost = infinity;
+    for (int a = 0; a < 3; a++) {
+        if (k[a] == 0)
+            continue;
+
+        // Sweep from the right to get the suffix areas, then from the left
+        // evaluating each of the sah_bin_count - 1 candidate planes.
+        double right_area[sah_bin_count];
+        size_t right_count[sah_bin_count];
+        aabb acc = empty_box();
+        size_t n = 0;
+        for (int b = sah_bin_count - 1; b > 0; b--) {
+            acc = surrounding_box(acc, bins.box[a][b]);
+            n += bins.count[a][b];
+            right_area[b] = n ? acc.surface_area() : 0;
+            right_count[b] = n;
+        }
+        acc = empty_box();
+        n = 0;
+        for (int b = 0; b < sah_bin_count - 1; b++) {
+            acc = surrounding_box(acc, bins.box[a][b]);
+            n += bins.count[a][b];
+            if (n == 0 || right_count[b + 1] == 0)
+                continue;
+            double cost = acc.surface_area() * n + right_area[b + 1] * right_count[b + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = a;
+                best_bin = b;
+            }
+        }
+    }
+
+    if (best_axis < 0) {
+        // All centroids coincide: binning cannot separate them.
+        if (count <= bvh_max_leaf_size)
+            return start;
+        return start + count / 2;
+    }
+    axis = best_axis;
+
+    double split_cost = sah_traversal_cost + sah_intersect_cost * best_cost / range.bounds.surface_area();
+    double leaf_cost = sah_intersect_cost * count;
+    if (count <= bvh_max_leaf_size && leaf_cost <= split_cost)
+        return start;
+
+    double split_lo = lo[best_axis];
+    double split_k = k[best_axis];
+    auto mid = std::partition(prims.begin() + start, prims.begin() + end,
+        [=](const bvh_primitive& p) {
+            return sah_bin(p.centroid[best_axis], split_lo, split_k) <= best_bin;
+        });
+    return size_t(mid - prims.begin());
 }
-class bvh_node : public hittable {
+
+// Flattened BVH: nodes sit in one array in depth-first order, so the left
+// child of node i is node i + 1 and only the right child needs an index.
+// Each node fills one 64-byte cache line.
+struct alignas(64) linear_bvh_node {
+    aabb box;
+    uint32_t offset;    // interior: right child index, leaf: first primitive
+    uint16_t count;     // primitives in a leaf, 0 for interior nodes
+    uint8_t axis;       // split axis, used to visit the near child first
+};
+static_assert(sizeof(linear_bvh_node) == 64, "linear_bvh_node should fill a cache line");
+
+class linear_bvh {
 public:
-    bvh_node();
+    // Builds over prims, reordering them so every leaf covers a contiguous
+    // range; prims[i].index then maps leaf slot i back to the caller's data.
+    void build(std::vector<bvh_primitive>& prims, thread_pool* pool = nullptr) {
+        external_nodes = nullptr;
+        nodes.clear();
+        nodes.reserve(prims.size() * 2);
+        if (!prims.empty())
+            build_range(prims, 0, prims.size(), 0, nodes, pool);
+    }
 
-    bvh_node(hittable_list& list, double time0, double time1)
-        : bvh_node(list.objects, 0, list.objects.size(), time0, time1)
-    {}
+    // Uses count nodes stored elsewhere, such as in a mapped mesh file,
+    // instead of building. They must stay valid for the tree's lifetime.
+    void attach(const linear_bvh_node* external, size_t count) {
+        nodes.clear();
+        external_nodes = external;
+        external_count = count;
+    }
 
-    bvh_node(
-        std::vector<shared_ptr<hittable>>& objects,
-        size_t start, size_t end, double time0, double time1);
+    const linear_bvh_node* node_data() const { return external_nodes ? external_nodes : nodes.data(); }
+    size_t node_count() const { return external_nodes ? external_count : nodes.size(); }
 
-    virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
-    virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+    aabb bounds() const { return node_count() == 0 ? empty_box() : node_data()[0].box; }
+
+    // Visits the leaves whose boxes the ray enters, near child first.
+    // leaf(first, count) tests primitives [first, first + count), may
+    // shrink t_max, and returns true to end the traversal early.
+    template <typename LeafFn>
+    void traverse(const ray& r, double t_min, double& t_max, LeafFn&& leaf) const {
+        if (node_count() == 0)
+            return;
+        const linear_bvh_node* nodes = node_data();
+        uint32_t stack[max_depth];
+        int sp = 0;
+        uint32_t index = 0;
+        while (true) {
+            const linear_bvh_node& node = nodes[index];
+            if (node.box.hit(r, t_min, t_max)) {
+                if (node.count > 0) {
+                    if (leaf(node.offset, node.count))
+                        return;
+                }
+                else if (r.sign[node.axis]) {
+                    stack[sp++] = index + 1;
+                    index = node.offset;
+                    continue;
+                }
+                else {
+                    stack[sp++] = node.offset;
+                    index = index + 1;
+                    continue;
+                }
+            }
+            if (sp == 0)
+                return;
+            index = stack[--sp];
+        }
+    }
 
 public:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb box;
+    std::vector<linear_bvh_node> nodes;
+    static const int max_depth = 64;    // deepest tree traverse() can walk
+
+private:
+    const linear_bvh_node* external_nodes = nullptr;
+    size_t external_count = 0;
+
+    // Appends the subtree over prims[start, end) to out. Child indices are
+    // relative to the start of out, so a subtree built into its own vector
+    // can be spliced in by shifting them.
+    static void build_range(std::vector<bvh_primitive>& prims, size_t start, size_t end,
+        int depth, std::vector<linear_bvh_node>& out, thread_pool* pool) {
+        bool parallel = pool && end - start >= bvh_parallel_threshold;
+        bvh_range_bounds range = range_bounds(prims, start, end, parallel ? pool : nullptr);
+
+        size_t index = out.size();
+        out.push_back(linear_bvh_node());
+        out[index].box = range.bounds;
+
+        int axis;
+        size_t mid = sah_partition(prims, start, end, range, axis, parallel ? pool : nullptr);
+        // Past this depth fall back to median splits, which halve the
+        // range each level and keep the traversal stack from overflowing.
+        if (depth > max_depth / 2 && end - start > bvh_max_leaf_size)
+            mid = start + (end - start) / 2;
+        if (mid == start) {
+            out[index].offset = uint32_t(start);
+            out[index].count = uint16_t(end - start);
+            return;
+        }
+        out[index].axis = uint8_t(axis);
+        out[index].count = 0;
+
+        if (!parallel) {
+            build_range(prims, start, mid, depth + 1, out, nullptr);
+            out[index].offset = uint32_t(out.size());
+            build_range(prims, mid, end, depth + 1, out, nullptr);
+            return;
+        }
+
+        std::vector<linear_bvh_node> left, right;
+        left.reserve((mid - start) * 2);
+        right.reserve((end - mid) * 2);
+        thread_pool::task_group group;
+        pool->run(group, [&] { build_range(prims, start, mid, depth + 1, left, pool); });
+        build_range(prims, mid, end, depth + 1, right, pool);
+        pool->wait(group);
+
+        splice(out, left);
+        out[index].offset = uint32_t(out.size());
+        splice(out, right);
+    }
+
+    static void splice(std::vector<linear_bvh_node>& out, const std::vector<linear_bvh_node>& sub) {
+        uint32_t base = uint32_t(out.size());
+        for (linear_bvh_node node : sub) {
+            if (node.count == 0)
+                node.offset += base;
+            out.push_back(node);
+        }
+    }
 };
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    if (!box.hit(r, t_min, t_max))
-        return false;
 
-    bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+// Branching factor of the tree bvh_node traverses: 2 keeps the binary
+// linear_bvh, 4 or 8 collapse it into a wide_bvh.
+#ifndef RT_BVH_WIDTH
+#define RT_BVH_WIDTH 4
+#endif
 
-    return hit_left || hit_right;
-}
-bool bvh_node::bounding_box(double t0, double t1, aabb& output_box) const {
-    output_box = box;
-    return true;
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define RT_BVH_SSE 1
+#endif
+
+// Rounds x to float towards -infinity (dir < 0) or +infinity (dir > 0), so
+// float child boxes always contain the real-valued ones.
+inline float round_float(double x, int dir) {
+    float f = float(x);
+    if (dir < 0 && double(f) > x)
+        f = std::nextafter(f, -std::numeric_limits<float>::infinity());
+    if (dir > 0 && double(f) < x)
+        f = std::nextafter(f, std::numeric_limits<float>::infinity());
+    return f;
 }
-bvh_node::bvh_node(
-    std::vector<shared_ptr<hittable>>& objects,
-    size_t start, size_t end, double time0, double time1
-) {
-    int axis = random_int(0, 2);
-    auto comparator = (axis == 0) ? box_x_compare
-        : (axis == 1) ? box_y_compare
-        : box_z_compare;
 
-    size_t object_span = end - start;
+// N-wide BVH node. Child boxes are stored structure-of-arrays, one float
+// lane per child, so one SIMD slab test covers every child at once.
+// Unused lanes have inverted boxes and never report a hit.
+template <int N>
+struct alignas(32) wide_bvh_node {
+    float bounds[6][N];     // min x, y, z then max x, y, z
+    uint32_t child[N];      // interior: node index, leaf: first primitive
+    uint16_t count[N];      // leaf size, 0 for an interior child
+};
 
-    if (object_span == 1) {
-        left = right = objects[start];
+// Ray data in the float form the wide slab test consumes.
+struct wide_bvh_ray {
+    float org[3];
+    float inv[3];
+    int near_plane[3];      // index into bounds[] of the entry plane per axis
+    int far_plane[3];
+};
+
+// Wide BVH made by collapsing a binary linear_bvh: each node adopts up to
+// N descendants, opening the largest interior child first. Leaves keep the
+// binary tree's primitive ranges, so the caller's primitive order is
+// unchanged.
+template <int N>
+class wide_bvh {
+public:
+    void build(const linear_bvh& binary) {
+        nodes.clear();
+        if (binary.node_count() == 0)
+            return;
+        const linear_bvh_node* src = binary.node_data();
+        if (src[0].count > 0) {
+            nodes.push_back(empty_node());
+            set_lane(nodes[0], 0, src[0], src[0].offset);
+            return;
+        }
+        collapse(src, 0);
     }
-    else if (object_span == 2) {
-        if (comparator(objects[start], objects[start + 1])) {
-            left = objects[start];
-            right = objects[start + 1];
+
+    // Same contract as linear_bvh::traverse. Children are visited nearest
+    // entry distance first, and stack entries whose entry distance lies
+    // beyond the current closest hit are dropped.
+    template <typename LeafFn>
+    void traverse(const ray& r, double t_min, double& t_max, LeafFn&& leaf) const {
+        if (nodes.empty())
+            return;
+        wide_bvh_ray wr;
+        for (int a = 0; a < 3; a++) {
+            wr.org[a] = float(r.origin()[a]);
+            wr.inv[a] = float(r.inv_direction()[a]);
+            wr.near_plane[a] = r.sign[a] ? 3 + a : a;
+            wr.far_plane[a] = r.sign[a] ? a : 3 + a;
         }
-        else {
-            left = objects[start + 1];
-            right = objects[start];
+
+        struct entry {
+            uint32_t child;
+            uint32_t count;
+            float t;
+        };
+        entry stack[max_stack];
+        int sp = 0;
+        stack[sp++] = entry{ 0, 0, float(t_min) };
+        while (sp > 0) {
+            entry e = stack[--sp];
+            if (e.t > t_max)
+                continue;
+            if (e.count > 0) {
+                if (leaf(e.child, e.count))
+                    return;
+                continue;
+            }
+
+            const wide_bvh_node<N>& node = nodes[e.child];
+            float tnear[N];
+            unsigned mask = intersect(node, wr, float(t_min), float(t_max), tnear);
+
+            // Push hit children farthest first so the nearest is popped next.
+            entry hits[N];
+            int n = 0;
+            for (; mask; mask &= mask - 1) {
+                int lane = lowest_bit(mask);
+                entry h{ node.child[lane], node.count[lane], tnear[lane] };
+                int k = n++;
+                while (k > 0 && hits[k - 1].t < h.t) {
+                    hits[k] = hits[k - 1];
+                    k--;
+                }
+                hits[k] = h;
+            }
+            for (int k = 0; k < n; k++)
+                stack[sp++] = hits[k];
+        }
+    }
+
+public:
+    std::vector<wide_bvh_node<N>> nodes;
+
+private:
+    static const int max_stack = 64 * N;
+
+    static int lowest_bit(unsigned mask) {
+        int i = 0;
+        while (!(mask & 1u)) {
+            mask >>= 1;
+            i++;
+        }
+        return i;
+    }
+
+    static wide_bvh_node<N> empty_node() {
+        wide_bvh_node<N> node;
+        for (int lane = 0; lane < N; lane++) {
+            for (int a = 0; a < 3; a++) {
+                node.bounds[a][lane] = std::numeric_limits<float>::infinity();
+                node.bounds[3 + a][lane] = -std::numeric_limits<float>::infinity();
+            }
+            node.child[lane] = 0;
+            node.count[lane] = 0;
+        }
+        return node;
+    }
+
+    static void set_lane(wide_bvh_node<N>& node, int lane, const linear_bvh_node& src, uint32_t child) {
+        for (int a = 0; a < 3; a++) {
+            node.bounds[a][lane] = round_float(src.box.min()[a], -1);
+            node.bounds[3 + a][lane] = round_float(src.box.max()[a], 1);
+        }
+        node.child[lane] = child;
+        node.count[lane] = src.count;
+    }
+
+    uint32_t collapse(const linear_bvh_node* binary, uint32_t index) {
+        uint32_t kids[N];
+        int n = 2;
+        kids[0] = index + 1;
+        kids[1] = binary[index].offset;
+        while (n < N) {
+            int best = -1;
+            double best_area = -1;
+            for (int k = 0; k < n; k++) {
+                const linear_bvh_node& c = binary[kids[k]];
+                if (c.count == 0 && c.box.surface_area() > best_area) {
+                    best_area = c.box.surface_area();
+                    best = k;
+                }
+            }
+            if (best < 0)
+                break;
+            uint32_t open = kids[best];
+            kids[best] = open + 1;
+            kids[n++] = binary[open].offset;
         }
+
+        uint32_t self = uint32_t(nodes.size());
+        nodes.push_back(empty_node());
+        for (int lane = 0; lane < n; lane++) {
+            const linear_bvh_node& c = binary[kids[lane]];
+            uint32_t child = c.count > 0 ? c.offset : collapse(binary, kids[lane]);
+            set_lane(nodes[self], lane, c, child);
+        }
+        return self;
+    }
+
+    // Slab test of the ray against all N children. Returns a bit mask of the
+    // lanes hit and writes their entry distances. Far distances are padded
+    // by a few ulps so float rounding cannot drop a grazing hit.
+    static unsigned intersect(const wide_bvh_node<N>& node, const wide_bvh_ray& r,
+        float t_min, float t_max, float* tnear);
+};
+
+template <int N>
+unsigned wide_bvh<N>::intersect(const wide_bvh_node<N>& node, const wide_bvh_ray& r,
+    float t_min, float t_max, float* tnear) {
+    const float pad = 1 + 4 * std::numeric_limits<float>::epsilon();
+    unsigned mask = 0;
+    for (int lane = 0; lane < N; lane++) {
+        float tn = t_min, tf = t_max;
+        for (int a = 0; a < 3; a++) {
+            float t0 = (node.bounds[r.near_plane[a]][lane] - r.org[a]) * r.inv[a];
+            float t1 = (node.bounds[r.far_plane[a]][lane] - r.org[a]) * r.inv[a] * pad;
+            tn = t0 > tn ? t0 : tn;
+            tf = t1 < tf ? t1 : tf;
+        }
+        tnear[lane] = tn;
+        mask |= unsigned(tn <= tf) << lane;
+    }
+    return mask;
+}
+
+#ifdef RT_BVH_SSE
+template <>
+inline unsigned wide_bvh<4>::intersect(const wide_bvh_node<4>& node, const wide_bvh_ray& r,
+    float t_min, float t_max, float* tnear) {
+    const __m128 pad = _mm_set1_ps(1 + 4 * std::numeric_limits<float>::epsilon());
+    __m128 tn = _mm_set1_ps(t_min);
+    __m128 tf = _mm_set1_ps(t_max);
+    for (int a = 0; a < 3; a++) {
+        __m128 o = _mm_set1_ps(r.org[a]);
+        __m128 inv = _mm_set1_ps(r.inv[a]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.near_plane[a]]), o), inv);
+        __m128 t1 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.far_plane[a]]), o), inv), pad);
+        // maxps/minps return the second operand when the first is NaN.
+        tn = _mm_max_ps(t0, tn);
+        tf = _mm_min_ps(t1, tf);
+    }
+    _mm_storeu_ps(tnear, tn);
+    return unsigned(_mm_movemask_ps(_mm_cmple_ps(tn, tf)));
+}
+#endif
+
+#ifdef __AVX__
+template <>
+inline unsigned wide_bvh<8>::intersect(const wide_bvh_node<8>& node, const wide_bvh_ray& r,
+    float t_min, float t_max, float* tnear) {
+    const __m256 pad = _mm256_set1_ps(1 + 4 * std::numeric_limits<float>::epsilon());
+    __m256 tn = _mm256_set1_ps(t_min);
+    __m256 tf = _mm256_set1_ps(t_max);
+    for (int a = 0; a < 3; a++) {
+        __m256 o = _mm256_set1_ps(r.org[a]);
+        __m256 inv = _mm256_set1_ps(r.inv[a]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[r.near_plane[a]]), o), inv);
+        __m256 t1 = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[r.far_plane[a]]), o), inv), pad);
+        tn = _mm256_max_ps(t0, tn);
+        tf = _mm256_min_ps(t1, tf);
+    }
+    _mm256_storeu_ps(tnear, tn);
+    return unsigned(_mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ)));
+}
+#endif
+
+// Acceleration structure shared by bvh_node and meshes: the binary
+// linear_bvh, plus its wide_bvh collapse when RT_BVH_WIDTH > 2. Callers
+// build (and may rearrange) the binary tree, then call finish().
+class bvh_tree {
+public:
+    void finish() {
+#if RT_BVH_WIDTH > 2
+        wide.build(binary);
+#endif
+    }
+
+    aabb bounds() const { return binary.bounds(); }
+
+    template <typename LeafFn>
+    void traverse(const ray& r, double t_min, double& t_max, LeafFn&& leaf) const {
+#if RT_BVH_WIDTH > 2
+        wide.traverse(r, t_min, t_max, leaf);
+#else
+        binary.traverse(r, t_min, t_max, leaf);
+#endif
+    }
+
+public:
+    linear_bvh binary;
+#if RT_BVH_WIDTH > 2
+    wide_bvh<RT_BVH_WIDTH> wide;
+#endif
+};
+
+class bvh_node : public hittable {
+public:
+    bvh_node() {}
+    bvh_node(hittable_list& list, double time0, double time1, thread_pool* pool = nullptr);
+
+    virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double tmin, double tmax) const;
+    virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
+
+public:
+    bvh_tree tree;
+    primitive_set store;
+    std::vector<primitive_ref> prims;   // in leaf order
+};
+
+bvh_node::bvh_node(hittable_list& list, double time0, double time1, thread_pool* pool) {
+    std::vector<primitive_ref> refs;
+    refs.reserve(list.objects.size());
+    for (const auto& object : list.objects)
+        store.add(object, refs);
+
+    std::vector<bvh_primitive> build_prims(refs.size());
+    auto prepare = [&](size_t i) {
+        if (!store.bounding_box(refs[i], time0, time1, build_prims[i].box))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+        build_prims[i].centroid = build_prims[i].box.centroid();
+        build_prims[i].index = i;
+    };
+    size_t n = build_prims.size();
+    if (pool && n >= bvh_parallel_threshold) {
+        size_t chunks = pool->size() * 4;
+        pool->parallel_for(chunks, [&](size_t c) {
+            for (size_t i = n * c / chunks; i < n * (c + 1) / chunks; i++)
+                prepare(i);
+        });
     }
     else {
-        std::sort(objects.begin() + start, objects.begin() + end, comparator);
+        for (size_t i = 0; i < n; i++)
+            prepare(i);
+    }
+    tree.binary.build(build_prims, pool);
 
-        auto mid = start + object_span / 2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+    // Lay the primitives out in leaf order, turning the spheres of each
+    // leaf into SIMD sphere batches.
+    prims.reserve(n);
+    std::vector<primitive_ref> leaf;
+    for (auto& node : tree.binary.nodes) {
+        if (node.count == 0)
+            continue;
+        leaf.clear();
+        for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+            leaf.push_back(refs[build_prims[i].index]);
+        store.batch_spheres(leaf);
+        node.offset = uint32_t(prims.size());
+        node.count = uint16_t(leaf.size());
+        prims.insert(prims.end(), leaf.begin(), leaf.end());
     }
+    tree.finish();
+}
 
-    aabb box_left, box_right;
+// Traversal only tracks the closest t and primitive; the hit record is
+// filled in once, for the final hit.
+bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    bool hit_anything = false;
+    surface_hit closest;
+    const primitive_ref* leaf_prims = prims.data();
+    tree.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++) {
+            if (store.intersect(leaf_prims[i], r, t_min, t_max, closest, rec)) {
+                t_max = closest.t;
+                hit_anything = true;
+            }
+        }
+        return false;
+    });
+    if (hit_anything)
+        store.surface(closest, r, rec);
+    return hit_anything;
+}
 
-    if (!left->bounding_box(time0, time1, box_left)
-        || !right->bounding_box(time0, time1, box_right)
-        )
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const {
+    bool blocked = false;
+    const primitive_ref* leaf_prims = prims.data();
+    tree.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++) {
+            if (store.occluded(leaf_prims[i], r, t_min, t_max)) {
+                blocked = true;
+                return true;
+            }
+        }
+        return false;
+    });
+    return blocked;
+}
 
-    box = surrounding_box(box_left, box_right);
+bool bvh_node::bounding_box(double t0, double t1, aabb& output_box) const {
+    output_box = tree.bounds();
+    return true;
 }
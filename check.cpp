@@ -0,0 +1,857 @@
+// Consistency checks for the acceleration structures, mesh files, light
+// sampling and the Sobol sampler.
+// Each one compares a fast path against a plain reference computed in the
+// same program, or loads a file it has just written. Build
+// and run from the repository root:
+//   g++ -std=c++17 -O2 -pthread check.cpp -o check && ./check
+// Failed checks are printed; the exit status is the number of failures.
+#include "rtweekend.h"
+#include "hittable_List.h"
+#include "bvh.h"
+#include "rectangle.h"
+#include "sphere.h"
+#include "light.h"
+#include "mesh.h"
+#include "mesh_file.h"
+#include "sobol.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+int failures = 0;
+
+void expect(bool ok, const std::string& what) {
+    if (ok)
+        return;
+    std::cerr << "FAIL: " << what << "\n";
+    failures++;
+}
+
+double uniform(pcg32& rng, double lo, double hi) {
+    return lo + (hi - lo) * rng.next_double();
+}
+
+vec3 uniform_point(pcg32& rng, double lo, double hi) {
+    return vec3(uniform(rng, lo, hi), uniform(rng, lo, hi), uniform(rng, lo, hi));
+}
+
+// n objects of every kind primitive_set stores, spread over a 100-unit cube.
+hittable_list random_scene(pcg32& rng, int n, material* m) {
+    hittable_list objects;
+    for (int i = 0; i < n; i++) {
+        vec3 c = uniform_point(rng, 0, 100);
+        double s = uniform(rng, 0.2, 3);
+        switch (rng.bounded(7)) {
+        case 0: case 1: case 2:
+            objects.add(make_shared<sphere>(c, s, m));
+            break;
+        case 3:
+            objects.add(make_shared<moving_sphere>(c, c + uniform_point(rng, -2, 2), 0, 1, s, m));
+            break;
+        case 4:
+            objects.add(make_shared<xy_rect>(c.x(), c.x() + s, c.y(), c.y() + s, c.z(), m));
+            break;
+        case 5:
+            objects.add(make_shared<xz_rect>(c.x(), c.x() + s, c.z(), c.z() + s, c.y(), m));
+            break;
+        default: {
+            shared_ptr<hittable> b = make_shared<box>(vec3(0, 0, 0), vec3(s, s, s), m);
+            b = make_shared<rotate_y>(b, uniform(rng, 0, 90));
+            objects.add(make_shared<translate>(b, c));
+            break;
+        }
+        }
+    }
+    return objects;
+}
+
+ray random_ray(pcg32& rng) {
+    vec3 d;
+    do {
+        d = uniform_point(rng, -1, 1);
+    } while (d.length_squared() < 1e-6);
+    return ray(uniform_point(rng, -20, 120), d, uniform(rng, 0, 1));
+}
+
+bool same_hit(bool a, const hit_record& ra, bool b, const hit_record& rb) {
+    if (a != b)
+        return false;
+    return !a || (std::fabs(ra.t - rb.t) <= 1e-6 * ffmax(1.0, std::fabs(ra.t))
+        && (ra.normal - rb.normal).length() < 1e-4);
+}
+
+bool contains(const aabb& outer, const aabb& inner) {
+    for (int a = 0; a < 3; a++)
+        if (inner.min()[a] < outer.min()[a] || inner.max()[a] > outer.max()[a])
+            return false;
+    return true;
+}
+
+// Closest hit through any tree with linear_bvh's traverse() contract over
+// bvh's primitives, the way bvh_node::hit runs its own tree.
+template <typename Tree>
+bool tree_hit(const Tree& tree, const bvh_node& bvh, const ray& r, double t_min, double t_max, hit_record& rec) {
+    bool found = false;
+    surface_hit closest;
+    tree.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++) {
+            if (bvh.store.intersect(bvh.prims[i], r, t_min, t_max, closest, rec)) {
+                t_max = closest.t;
+                found = true;
+            }
+        }
+        return false;
+    });
+    if (found)
+        bvh.store.surface(closest, r, rec);
+    return found;
+}
+
+template <typename Tree>
+bool tree_occluded(const Tree& tree, const bvh_node& bvh, const ray& r, double t_min, double t_max) {
+    bool blocked = false;
+    tree.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++) {
+            if (bvh.store.occluded(bvh.prims[i], r, t_min, t_max)) {
+                blocked = true;
+                return true;
+            }
+        }
+        return false;
+    });
+    return blocked;
+}
+
+// The flattened tree must cover every primitive slot exactly once, keep
+// each child box inside its parent's, and stay within the traversal stack.
+void check_flat_layout(const char* name, const bvh_node& bvh) {
+    const linear_bvh& tree = bvh.tree.binary;
+    std::vector<int> covered(bvh.prims.size(), 0);
+    bool nested = true, in_range = true;
+    int deepest = 0;
+    struct item { uint32_t node; int depth; };
+    std::vector<item> todo{ item{ 0, 0 } };
+    while (!todo.empty()) {
+        item it = todo.back();
+        todo.pop_back();
+        deepest = std::max(deepest, it.depth);
+        const linear_bvh_node& node = tree.nodes[it.node];
+        if (node.count > 0) {
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                if (i < covered.size())
+                    covered[i]++;
+                else
+                    in_range = false;
+            }
+            continue;
+        }
+        for (uint32_t child : { it.node + 1, node.offset }) {
+            if (child >= tree.nodes.size()) {
+                in_range = false;
+                continue;
+            }
+            nested = nested && contains(node.box, tree.nodes[child].box);
+            todo.push_back(item{ child, it.depth + 1 });
+        }
+    }
+    int once = 0;
+    for (int c : covered)
+        once += c == 1;
+    std::string what = std::string(name) + " flattened tree";
+    expect(in_range, what + ": child or primitive index out of range");
+    expect(once == int(covered.size()), what + ": " + std::to_string(covered.size() - once)
+        + " primitive slots not in exactly one leaf");
+    expect(nested, what + ": a child box pokes out of its parent");
+    expect(deepest < linear_bvh::max_depth, what + ": deeper than the traversal stack");
+}
+
+// bvh_node against a brute-force hittable_list on the same objects, for
+// closest hits and for occlusion up to a distance short of the list's hit.
+void check_bvh(const char* name, hittable_list& world, thread_pool* pool, pcg32& rng, int rays) {
+    bvh_node bvh(world, 0, 1, pool);
+    check_flat_layout(name, bvh);
+    // Both widths are checked whatever RT_BVH_WIDTH bvh_node was built with.
+    wide_bvh<4> wide4;
+    wide_bvh<8> wide8;
+    wide4.build(bvh.tree.binary);
+    wide8.build(bvh.tree.binary);
+    int hit_mismatches = 0, occluded_mismatches = 0, hits = 0, flat_mismatches = 0;
+    int wide_mismatches = 0;
+    for (int i = 0; i < rays; i++) {
+        ray r = random_ray(rng);
+        hit_record list_rec, bvh_rec;
+        bool list_hit = world.hit(r, 0.001, infinity, list_rec);
+        bool bvh_hit = bvh.hit(r, 0.001, infinity, bvh_rec);
+        hits += list_hit;
+        hit_mismatches += !same_hit(list_hit, list_rec, bvh_hit, bvh_rec);
+        hit_record flat_rec;
+        bool flat_hit = tree_hit(bvh.tree.binary, bvh, r, 0.001, infinity, flat_rec);
+        flat_mismatches += !same_hit(list_hit, list_rec, flat_hit, flat_rec);
+        hit_record wide4_rec, wide8_rec;
+        bool wide4_hit = tree_hit(wide4, bvh, r, 0.001, infinity, wide4_rec);
+        bool wide8_hit = tree_hit(wide8, bvh, r, 0.001, infinity, wide8_rec);
+        wide_mismatches += !same_hit(list_hit, list_rec, wide4_hit, wide4_rec);
+        wide_mismatches += !same_hit(list_hit, list_rec, wide8_hit, wide8_rec);
+        double t_max = list_hit ? ffmax(0.002, list_rec.t * uniform(rng, 0.5, 1.5)) : infinity;
+        bool list_blocked = world.occluded(r, 0.001, t_max);
+        occluded_mismatches += list_blocked != bvh.occluded(r, 0.001, t_max);
+        wide_mismatches += list_blocked != tree_occluded(wide4, bvh, r, 0.001, t_max);
+        wide_mismatches += list_blocked != tree_occluded(wide8, bvh, r, 0.001, t_max);
+    }
+    std::string what = std::string(name) + " (" + std::to_string(world.objects.size()) + " objects, "
+        + std::to_string(hits) + "/" + std::to_string(rays) + " rays hit)";
+    expect(hit_mismatches == 0, what + ": " + std::to_string(hit_mismatches) + " closest hits differ from the list");
+    expect(flat_mismatches == 0, what + ": " + std::to_string(flat_mismatches) + " binary-tree hits differ from the list");
+    expect(wide_mismatches == 0, what + ": " + std::to_string(wide_mismatches) + " 4- or 8-wide tree answers differ from the list");
+    expect(occluded_mismatches == 0, what + ": " + std::to_string(occluded_mismatches) + " occlusion answers differ from the list");
+}
+
+// Writes contents to a scratch file in the working directory and returns
+// its path. The caller removes it.
+std::string scratch_file(const std::string& ext, const std::string& contents) {
+    std::string path = "check_scratch" + ext;
+    std::ofstream out(path, std::ios::binary);
+    out.write(contents.data(), contents.size());
+    return path;
+}
+
+// Silences std::cerr while malformed input is loaded on purpose.
+struct quiet_errors {
+    quiet_errors() : saved(std::cerr.rdbuf(nullptr)) {}
+    ~quiet_errors() { std::cerr.rdbuf(saved); }
+    std::streambuf* saved;
+};
+
+bool load_scratch(const std::string& ext, const std::string& contents, mesh_data& mesh) {
+    std::string path = scratch_file(ext, contents);
+    bool ok = load_mesh(path, mesh);
+    std::remove(path.c_str());
+    return ok;
+}
+
+// Loads input the loader should reject, without its error message.
+bool load_malformed(const std::string& ext, const std::string& contents, mesh_data& mesh) {
+    quiet_errors quiet;
+    return load_scratch(ext, contents, mesh);
+}
+
+vec3 vertex(const mesh_data& mesh, uint32_t v) {
+    return vec3(mesh.positions[v * 3], mesh.positions[v * 3 + 1], mesh.positions[v * 3 + 2]);
+}
+
+// True if mesh holds exactly the triangles of expected, in order, each
+// given as three positions.
+bool same_triangles(const mesh_data& mesh, const std::vector<vec3>& expected) {
+    if (mesh.indices.size() != expected.size())
+        return false;
+    for (size_t i = 0; i < expected.size(); i++)
+        if ((vertex(mesh, mesh.indices[i]) - expected[i]).length() > 1e-6)
+            return false;
+    return true;
+}
+
+// A unit cube as six quads, with per-face normals and uvs, and the twelve
+// triangles the loaders should fan it into.
+const float cube_corners[8][3] = {
+    { 0, 0, 0 }, { 1, 0, 0 }, { 1, 1, 0 }, { 0, 1, 0 },
+    { 0, 0, 1 }, { 1, 0, 1 }, { 1, 1, 1 }, { 0, 1, 1 } };
+const int cube_faces[6][4] = {
+    { 0, 3, 2, 1 }, { 4, 5, 6, 7 }, { 0, 1, 5, 4 },
+    { 3, 7, 6, 2 }, { 0, 4, 7, 3 }, { 1, 2, 6, 5 } };
+const float cube_normals[6][3] = {
+    { 0, 0, -1 }, { 0, 0, 1 }, { 0, -1, 0 }, { 0, 1, 0 }, { -1, 0, 0 }, { 1, 0, 0 } };
+
+std::vector<vec3> cube_triangles() {
+    std::vector<vec3> out;
+    for (const auto& f : cube_faces) {
+        for (int k = 2; k < 4; k++) {
+            for (int c : { f[0], f[k - 1], f[k] })
+                out.push_back(vec3(cube_corners[c][0], cube_corners[c][1], cube_corners[c][2]));
+        }
+    }
+    return out;
+}
+
+void check_obj() {
+    std::string obj = "# cube\n";
+    for (const auto& c : cube_corners)
+        obj += "v " + std::to_string(c[0]) + " " + std::to_string(c[1]) + " " + std::to_string(c[2]) + "\n";
+    obj += "vt 0 0\nvt 1 0\nvt 1 1\nvt 0 1\n";
+    for (const auto& n : cube_normals)
+        obj += "vn " + std::to_string(n[0]) + " " + std::to_string(n[1]) + " " + std::to_string(n[2]) + "\n";
+    for (int f = 0; f < 6; f++) {
+        obj += "f";
+        for (int k = 0; k < 4; k++)
+            obj += " " + std::to_string(cube_faces[f][k] + 1) + "/" + std::to_string(k + 1) + "/" + std::to_string(f + 1);
+        obj += f % 2 ? "\r\n" : "\n";
+    }
+    mesh_data mesh;
+    bool ok = load_scratch(".obj", obj, mesh);
+    expect(ok && same_triangles(mesh, cube_triangles()), "OBJ cube: triangles differ from the quads written");
+    // Each corner of each face has its own normal, so nothing welds.
+    expect(ok && mesh.vertex_count() == 24 && mesh.normals.size() == 72 && mesh.uvs.size() == 48,
+        "OBJ cube: expected 24 vertices with normals and uvs");
+
+    // Positions only, with negative (relative) indices: the 8 corners weld.
+    std::string relative;
+    for (const auto& c : cube_corners)
+        relative += "v " + std::to_string(c[0]) + " " + std::to_string(c[1]) + " " + std::to_string(c[2]) + "\n";
+    for (const auto& f : cube_faces)
+        relative += "f " + std::to_string(f[0] - 8) + " " + std::to_string(f[1] - 8) + " "
+            + std::to_string(f[2] - 8) + " " + std::to_string(f[3] - 8) + "\n";
+    ok = load_scratch(".obj", relative, mesh);
+    expect(ok && same_triangles(mesh, cube_triangles()) && mesh.vertex_count() == 8 && mesh.normals.empty(),
+        "OBJ cube with relative indices: expected 12 triangles over 8 vertices");
+
+    const char* malformed[] = {
+        "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 4\n",     // index past the last vertex
+        "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 -4\n",    // relative index before the first
+        "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 x 3\n",     // not a number
+        "v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1/1 2/1 3/1\n" };  // uv that was never given
+    for (const char* text : malformed)
+        expect(!load_malformed(".obj", text, mesh), std::string("OBJ accepted malformed input: ") + text);
+    bool missing;
+    {
+        quiet_errors quiet;
+        missing = load_mesh("check_missing.obj", mesh);
+    }
+    expect(!missing, "OBJ: loading a missing file succeeded");
+}
+
+// Binary PLY of the cube in the given byte order: float x y z nx ny nz
+// vertices (one per face corner) and quads with a uchar count and the
+// given index type.
+std::string cube_ply(bool big_endian, const char* index_type, int index_size,
+    const std::string& vertex_count = "24") {
+    std::string out = std::string("ply\nformat ") + (big_endian ? "binary_big_endian" : "binary_little_endian")
+        + " 1.0\ncomment written by check.cpp\nelement vertex " + vertex_count + "\n"
+        + "property float x\nproperty float y\nproperty float z\n"
+        + "property float nx\nproperty float ny\nproperty float nz\n"
+        + "element face 6\nproperty list uchar " + index_type + " vertex_indices\nend_header\n";
+    const uint16_t probe = 1;
+    const bool host_big_endian = *reinterpret_cast<const unsigned char*>(&probe) == 0;
+    auto put = [&](const void* bytes, int n) {
+        const char* b = static_cast<const char*>(bytes);
+        for (int k = 0; k < n; k++)
+            out += b[big_endian != host_big_endian ? n - 1 - k : k];
+    };
+    for (int f = 0; f < 6; f++) {
+        for (int k = 0; k < 4; k++) {
+            put(cube_corners[cube_faces[f][k]], 4);
+            put(cube_corners[cube_faces[f][k]] + 1, 4);
+            put(cube_corners[cube_faces[f][k]] + 2, 4);
+            for (int a = 0; a < 3; a++)
+                put(&cube_normals[f][a], 4);
+        }
+    }
+    for (int f = 0; f < 6; f++) {
+        out += char(4);
+        for (int k = 0; k < 4; k++) {
+            uint32_t v = uint32_t(f * 4 + k);
+            uint16_t v16 = uint16_t(v);
+            put(index_size == 2 ? static_cast<const void*>(&v16) : &v, index_size);
+        }
+    }
+    return out;
+}
+
+void check_ply() {
+    mesh_data mesh;
+    for (bool big_endian : { false, true }) {
+        for (int index_size : { 2, 4 }) {
+            std::string ply = cube_ply(big_endian, index_size == 2 ? "ushort" : "int", index_size);
+            bool ok = load_scratch(".ply", ply, mesh);
+            std::string what = std::string("PLY cube (") + (big_endian ? "big" : "little") + " endian, "
+                + std::to_string(index_size) + "-byte indices)";
+            expect(ok && same_triangles(mesh, cube_triangles()), what + ": triangles differ from the quads written");
+            expect(ok && mesh.normals.size() == 72 && mesh.normals[2] == -1, what + ": normals not read back");
+
+            // Every strict prefix of the data is truncated.
+            size_t data = ply.find("end_header\n") + 11;
+            bool truncated_rejected = true;
+            for (size_t cut = data; cut < ply.size(); cut += 7)
+                truncated_rejected = truncated_rejected && !load_malformed(".ply", ply.substr(0, cut), mesh);
+            expect(truncated_rejected, what + ": a truncated file loaded");
+        }
+    }
+
+    // A header count far beyond the file must fail cleanly, not allocate.
+    bool ok = false;
+    try {
+        ok = load_malformed(".ply", cube_ply(false, "int", 4, "999999999999999"), mesh);
+    }
+    catch (const std::exception& e) {
+        expect(false, std::string("PLY with a huge vertex count threw ") + e.what());
+    }
+    expect(!ok, "PLY with a huge vertex count loaded");
+
+    std::string bad_index = cube_ply(false, "int", 4);
+    bad_index[bad_index.size() - 1] = char(0x7f);   // last index far past the vertices
+    expect(!load_malformed(".ply", bad_index, mesh), "PLY with a face index out of range loaded");
+    std::string ascii = cube_ply(false, "int", 4);
+    ascii.replace(ascii.find("binary_little_endian"), 20, "ascii");
+    expect(!load_malformed(".ply", ascii, mesh), "ASCII PLY loaded");
+    std::string unknown_type = cube_ply(false, "int", 4);
+    unknown_type.replace(unknown_type.find("property float nx"), 17, "property quad nx");
+    expect(!load_malformed(".ply", unknown_type, mesh), "PLY with an unknown property type loaded");
+    expect(!load_malformed(".ply", "ply\nformat binary_little_endian 1.0\nelement vertex 3\n", mesh),
+        "PLY without end_header loaded");
+}
+
+// n random triangles in the 100-unit cube, unwelded.
+mesh_data random_soup(pcg32& rng, int n) {
+    mesh_data soup;
+    for (int i = 0; i < n; i++) {
+        vec3 c = uniform_point(rng, 0, 100);
+        for (int k = 0; k < 3; k++) {
+            vec3 p = c + uniform_point(rng, -3, 3);
+            soup.positions.insert(soup.positions.end(), { float(p.x()), float(p.y()), float(p.z()) });
+            soup.indices.push_back(uint32_t(i * 3 + k));
+        }
+    }
+    return soup;
+}
+
+// triangle_mesh against a loop over all triangles, on a random triangle
+// soup; then rays through the vertices and edges of a tessellated square,
+// which a watertight test must never let through.
+void check_triangle_mesh(pcg32& rng, lambertian* m) {
+    mesh_data soup = random_soup(rng, 3000);
+    triangle_mesh mesh(soup, m);
+    int mismatches = 0, hits = 0;
+    for (int i = 0; i < 3000; i++) {
+        ray r = random_ray(rng);
+        watertight_ray wr(r);
+        bool found = false;
+        real best = infinity;
+        for (size_t tri = 0; tri < soup.triangle_count(); tri++) {
+            real t, b1, b2;
+            const uint32_t* idx = &soup.indices[tri * 3];
+            if (intersect_triangle(wr, vertex(soup, idx[0]), vertex(soup, idx[1]), vertex(soup, idx[2]),
+                0.001, best, t, b1, b2)) {
+                best = t;
+                found = true;
+            }
+        }
+        hit_record rec;
+        bool mesh_hit = mesh.hit(r, 0.001, infinity, rec);
+        hits += found;
+        mismatches += mesh_hit != found || (found && std::fabs(rec.t - best) > 1e-6 * best);
+        mismatches += mesh.occluded(r, 0.001, infinity) != found;
+    }
+    expect(mismatches == 0, "triangle_mesh (" + std::to_string(hits) + "/3000 rays hit): "
+        + std::to_string(mismatches) + " answers differ from a loop over the triangles");
+
+    // 32 x 32 quads over [0, 1]^2 at z = 0, split along alternating diagonals.
+    const int n = 32;
+    mesh_data grid;
+    for (int y = 0; y <= n; y++)
+        for (int x = 0; x <= n; x++)
+            grid.positions.insert(grid.positions.end(), { float(x) / n, float(y) / n, 0.0f });
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            uint32_t a = uint32_t(y * (n + 1) + x), b = a + 1, c = a + n + 1, d = c + 1;
+            if ((x + y) % 2)
+                grid.indices.insert(grid.indices.end(), { a, b, d, a, d, c });
+            else
+                grid.indices.insert(grid.indices.end(), { a, b, c, b, d, c });
+        }
+    }
+    triangle_mesh square(grid, m);
+    int leaks = 0;
+    for (int y = 1; y < 4 * n; y++) {
+        for (int x = 1; x < 4 * n; x++) {
+            // Aim at points on the edges and vertices from skewed origins.
+            vec3 target(double(x) / (4 * n), double(y) / (4 * n), 0);
+            vec3 origin = target + vec3(uniform(rng, -1, 1), uniform(rng, -1, 1), uniform(rng, 0.5, 2));
+            hit_record rec;
+            leaks += !square.hit(ray(origin, target - origin), 0.001, infinity, rec);
+        }
+    }
+    expect(leaks == 0, "triangle_mesh: " + std::to_string(leaks) + " rays at shared edges slipped through");
+}
+
+// Faces before the first usemtl must keep the mesh's default material,
+// and named ones the material their name was bound to.
+void check_obj_materials(lambertian* default_material, lambertian* red) {
+    const char* obj =
+        "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nv 2 0 0\nv 2 1 0\n"
+        "f 1 2 3 4\n"
+        "usemtl red\n"
+        "f 2 5 6 3\n";
+    mesh_data data;
+    bool ok = load_scratch(".obj", obj, data);
+    expect(ok && data.material_names == std::vector<std::string>{ "red" }
+        && data.material_ids == std::vector<uint32_t>{ UINT32_MAX, UINT32_MAX, 0, 0 },
+        "OBJ usemtl: expected ids UINT32_MAX for the first face and 0 for the red one");
+    if (!ok)
+        return;
+    triangle_mesh mesh(data, default_material);
+    mesh.materials = { red };
+    hit_record first, second;
+    bool hit_first = mesh.hit(ray(vec3(0.5, 0.5, 1), vec3(0, 0, -1)), 0.001, infinity, first);
+    bool hit_second = mesh.hit(ray(vec3(1.5, 0.5, 1), vec3(0, 0, -1)), 0.001, infinity, second);
+    expect(hit_first && first.mat_ptr == default_material, "OBJ usemtl: a face before usemtl did not get the default material");
+    expect(hit_second && second.mat_ptr == red, "OBJ usemtl: a face after usemtl red did not get red");
+}
+
+// Opens a mesh file that open_mesh_file should reject, without its error
+// message.
+bool open_corrupt(const std::string& contents) {
+    std::string path = scratch_file(".rtm", contents);
+    mesh_file mf;
+    bool ok;
+    {
+        quiet_errors quiet;
+        ok = open_mesh_file(path, mf);
+    }
+    mf.file.reset();
+    std::remove(path.c_str());
+    return ok;
+}
+
+template <typename T>
+bool same_array(const T* a, const T* b, size_t count) {
+    return (a == nullptr) == (b == nullptr) && (!a || std::memcmp(a, b, count * sizeof(T)) == 0);
+}
+
+// A mesh written to .rtm must map back to the same buffers, names and BVH,
+// and render the same. Damaged copies of the file must fail to open.
+void check_mesh_file(pcg32& rng, lambertian* m, lambertian* red) {
+    mesh_data data = random_soup(rng, 2000);
+    for (size_t v = 0; v < data.vertex_count(); v++) {
+        data.normals.insert(data.normals.end(), { 0.0f, 0.0f, 1.0f });
+        data.uvs.insert(data.uvs.end(), { float(v % 7) / 7, float(v % 5) / 5 });
+    }
+    for (size_t t = 0; t < data.triangle_count(); t++)
+        data.material_ids.push_back(t % 3 == 0 ? UINT32_MAX : uint32_t(t % 2));
+    const std::vector<std::string> names = { "red", "white" };
+    triangle_mesh mesh(data, m);
+    mesh.materials = { red, m };
+
+    const std::string path = "check_scratch.rtm";
+    expect(write_mesh_file(path, mesh, names), "mesh file: write failed");
+    std::string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    {
+        mesh_file mf;
+        bool ok = open_mesh_file(path, mf);
+        const mesh_view& a = mesh.view;
+        const mesh_view& b = mf.view;
+        ok = ok && a.vertex_count == b.vertex_count && a.triangle_count == b.triangle_count
+            && same_array(a.positions, b.positions, a.vertex_count * 3)
+            && same_array(a.normals, b.normals, a.vertex_count * 3)
+            && same_array(a.uvs, b.uvs, a.vertex_count * 2)
+            && same_array(a.indices, b.indices, a.triangle_count * 3)
+            && same_array(a.material_ids, b.material_ids, a.triangle_count);
+        expect(ok, "mesh file: buffers differ after a round trip");
+        expect(mf.material_names == names, "mesh file: material names differ after a round trip");
+        expect(mf.node_count == mesh.tree.binary.node_count()
+            && same_array(mf.nodes, mesh.tree.binary.node_data(), mf.node_count),
+            "mesh file: BVH nodes differ after a round trip");
+
+        auto mapped = load_mesh_file(path, m);
+        int mismatches = 0;
+        if (mapped) {
+            mapped->materials = { red, m };
+            for (int i = 0; i < 2000; i++) {
+                ray r = random_ray(rng);
+                hit_record a_rec, b_rec;
+                bool a_hit = mesh.hit(r, 0.001, infinity, a_rec);
+                bool b_hit = mapped->hit(r, 0.001, infinity, b_rec);
+                mismatches += a_hit != b_hit
+                    || (a_hit && (a_rec.t != b_rec.t || a_rec.mat_ptr != b_rec.mat_ptr || a_rec.u != b_rec.u));
+            }
+        }
+        expect(mapped && mismatches == 0, "mesh file: the mapped mesh renders "
+            + std::to_string(mismatches) + " rays differently");
+    }
+    std::remove(path.c_str());
+
+    mesh_file_header h;
+    std::memcpy(&h, bytes.data(), sizeof h);
+    auto patched = [&](uint64_t offset, const void* value, size_t size) {
+        std::string copy = bytes;
+        std::memcpy(&copy[size_t(offset)], value, size);
+        return copy;
+    };
+    const uint32_t big_index = uint32_t(h.vertex_count);
+    const uint32_t bad_version = mesh_file_version + 1;
+    const uint64_t huge = UINT64_C(1) << 60;
+    const uint64_t unaligned = h.indices + 4;
+    linear_bvh_node loop = mesh.tree.binary.nodes[0];
+    loop.offset = 0;    // the root's right child is the root again
+    const struct { const char* what; std::string contents; } corrupt[] = {
+        { "empty file", std::string() },
+        { "header only", bytes.substr(0, sizeof h) },
+        { "cut in the index section", bytes.substr(0, size_t(h.indices) + 100) },
+        { "bad magic", patched(0, "RTMESH\1", 8) },
+        { "unknown version", patched(offsetof(mesh_file_header, version), &bad_version, 4) },
+        { "vertex index out of range", patched(h.indices + 40, &big_index, 4) },
+        { "huge triangle count", patched(offsetof(mesh_file_header, triangle_count), &huge, 8) },
+        { "unaligned section", patched(offsetof(mesh_file_header, indices), &unaligned, 8) },
+        { "BVH node pointing back at the root", patched(h.nodes, &loop, sizeof loop) },
+    };
+    for (const auto& c : corrupt)
+        expect(!open_corrupt(c.contents), std::string("mesh file: opened a file with ") + c.what);
+}
+
+// The table's pmf must be each weight's share, and sampling a fine grid of
+// u must pick every index at that rate and never pick a zero weight.
+void check_alias_table(const char* name, const std::vector<double>& weights) {
+    alias_table table;
+    table.build(weights);
+    const size_t n = weights.size();
+    double total = 0;
+    for (double w : weights)
+        total += w;
+    double pmf_sum = 0, worst_share = 0;
+    for (size_t i = 0; i < n; i++) {
+        pmf_sum += table.pmf(i);
+        double share = total > 0 ? weights[i] / total : 1.0 / n;
+        worst_share = ffmax(worst_share, std::fabs(table.pmf(i) - share));
+    }
+    const size_t steps = n * 4096;
+    std::vector<size_t> picks(n, 0);
+    for (size_t k = 0; k < steps; k++)
+        picks[table.sample((k + 0.5) / steps)]++;
+    double worst_rate = 0;
+    bool zero_picked = false;
+    for (size_t i = 0; i < n; i++) {
+        worst_rate = ffmax(worst_rate, std::fabs(double(picks[i]) / steps - table.pmf(i)));
+        zero_picked = zero_picked || (total > 0 && weights[i] == 0 && picks[i] > 0);
+    }
+    std::string what = std::string("alias table, ") + name;
+    expect(std::fabs(pmf_sum - 1) < 1e-5, what + ": pmfs sum to " + std::to_string(pmf_sum));
+    expect(worst_share < 1e-6, what + ": a pmf differs from its weight's share by " + std::to_string(worst_share));
+    expect(worst_rate < 1e-3, what + ": an index is sampled at a rate off its pmf by " + std::to_string(worst_rate));
+    expect(!zero_picked, what + ": sampled an index of weight zero");
+}
+
+// A few hundred lights of random size, power and facing: spheres and
+// downward-facing ceiling rects.
+light_list random_lights(pcg32& rng, int n, material* m) {
+    light_list lights;
+    for (int i = 0; i < n; i++) {
+        vec3 c = uniform_point(rng, 0, 100);
+        vec3 radiance = uniform_point(rng, 0, 1) * (rng.bounded(4) == 0 ? 100 : 1);
+        if (rng.bounded(2)) {
+            double s = uniform(rng, 0.5, 4);
+            lights.add(make_shared<xz_rect>(c.x(), c.x() + s, c.z(), c.z() + s, c.y(), m), radiance, vec3(0, -1, 0));
+        }
+        else {
+            lights.add(make_shared<sphere>(c, uniform(rng, 0.2, 2), m), radiance);
+        }
+    }
+    lights.build();
+    return lights;
+}
+
+void check_light_power(pcg32& rng, material* m) {
+    check_alias_table("uniform", std::vector<double>(5, 2.0));
+    check_alias_table("single weight", { 3.0 });
+    check_alias_table("all zero", { 0.0, 0.0, 0.0 });
+    check_alias_table("1e-6 to 1e6", { 1e-6, 1e6, 1, 0, 1e3, 1e-3, 0, 7 });
+    std::vector<double> weights;
+    for (int i = 0; i < 1000; i++)
+        weights.push_back(rng.bounded(10) == 0 ? 0 : uniform(rng, 0, 1) * uniform(rng, 0, 100));
+    check_alias_table("1000 random weights", weights);
+
+    light_list lights = random_lights(rng, 300, m);
+    double total = 0, worst = 0;
+    for (double w : lights.power)
+        total += w;
+    for (size_t i = 0; i < lights.size(); i++)
+        worst = ffmax(worst, std::fabs(lights.pmf(i) - lights.power[i] / total));
+    expect(worst < 1e-6, "light_list: a light's pmf differs from its share of the power by " + std::to_string(worst));
+
+    // pdf_value gathers lights through the tree; a loop over all of them
+    // must agree.
+    int mismatches = 0;
+    for (int k = 0; k < 2000; k++) {
+        vec3 o = uniform_point(rng, -10, 110);
+        vec3 v = uniform_point(rng, -1, 1);
+        double expected = 0;
+        for (size_t i = 0; i < lights.size(); i++)
+            expected += lights.pmf(i) * lights.shapes[i]->pdf_value(o, v);
+        double got = lights.pdf_value(o, v);
+        mismatches += std::fabs(got - expected) > 1e-4 * ffmax(1.0, expected);
+    }
+    expect(mismatches == 0, "light_list: " + std::to_string(mismatches)
+        + " pdf_value results differ from a loop over all lights");
+}
+
+// For random shading points, the light tree's pmfs must sum to 1, and the
+// pdf sample_direction reports with each direction must be the one
+// surface_pdf_value computes for it from those pmfs.
+void check_light_tree(pcg32& rng, material* m) {
+    light_list lights = random_lights(rng, 300, m);
+    double worst_sum = 0;
+    int negative = 0, pdf_mismatches = 0, samples = 0;
+    for (int k = 0; k < 1000; k++) {
+        vec3 o = uniform_point(rng, -10, 110);
+        vec3 n = unit_vector(uniform_point(rng, -1, 1));
+        double sum = 0;
+        for (size_t i = 0; i < lights.size(); i++) {
+            double p = lights.pmf(i, o, n);
+            negative += p < 0;
+            sum += p;
+        }
+        worst_sum = ffmax(worst_sum, std::fabs(sum - 1));
+        for (int j = 0; j < 4; j++) {
+            // The sampler hands out a bounded number of values per sample.
+            seed_random(uint64_t(k), uint64_t(j));
+            float pdf;
+            vec3 v = lights.sample_direction(o, n, pdf);
+            if (!(pdf > 0))
+                continue;
+            samples++;
+            float expected = lights.surface_pdf_value(o, n, v);
+            pdf_mismatches += std::fabs(pdf - expected) > 1e-3 * ffmax(1.0, expected);
+        }
+    }
+    expect(worst_sum < 1e-6, "light tree: pmfs at a point sum to 1 +- " + std::to_string(worst_sum));
+    expect(negative == 0, "light tree: " + std::to_string(negative) + " negative pmfs");
+    expect(pdf_mismatches == 0, "light tree: " + std::to_string(pdf_mismatches) + " of "
+        + std::to_string(samples) + " sampled pdfs differ from surface_pdf_value");
+
+    // Above every downward-facing light, no light has importance and the
+    // tree falls back to the power table.
+    light_list ceiling;
+    for (int i = 0; i < 20; i++) {
+        vec3 c = uniform_point(rng, 0, 100);
+        ceiling.add(make_shared<xz_rect>(c.x(), c.x() + 2, c.z(), c.z() + 2, c.y(), m),
+            uniform_point(rng, 0, 1), vec3(0, -1, 0));
+    }
+    ceiling.build();
+    double sum = 0, worst = 0;
+    for (size_t i = 0; i < ceiling.size(); i++) {
+        double p = ceiling.pmf(i, vec3(50, 200, 50), vec3(0, 1, 0));
+        sum += p;
+        worst = ffmax(worst, std::fabs(p - ceiling.pmf(i)));
+    }
+    expect(std::fabs(sum - 1) < 1e-6 && worst < 1e-7, "light tree: the fallback to the power table has the wrong pmfs");
+}
+
+// True if each of the 2^k intervals of width 2^-k holds one of the 2^k
+// values, as 32-bit fractions.
+bool is_stratified(const std::vector<uint32_t>& x, int k) {
+    std::vector<bool> taken(x.size(), false);
+    for (uint32_t v : x) {
+        const size_t cell = k ? v >> (32 - k) : 0;
+        if (taken[cell])
+            return false;
+        taken[cell] = true;
+    }
+    return true;
+}
+
+// True if the 2^k points (x[i], y[i]), as 32-bit fractions, form a
+// (0, k, 2)-net: every elementary interval of area 2^-k, from 2^k x 1
+// columns to 1 x 2^k rows, holds exactly one point.
+bool is_net(const std::vector<uint32_t>& x, const std::vector<uint32_t>& y, int k) {
+    const size_t n = size_t(1) << k;
+    for (int a = 0; a <= k; a++) {
+        const int b = k - a;
+        std::vector<bool> taken(n, false);
+        for (size_t i = 0; i < n; i++) {
+            const size_t cx = a ? x[i] >> (32 - a) : 0;
+            const size_t cy = b ? y[i] >> (32 - b) : 0;
+            const size_t cell = (cx << b) | cy;
+            if (taken[cell])
+                return false;
+            taken[cell] = true;
+        }
+    }
+    return true;
+}
+
+// Over the first 2^k samples of a pixel, for every 2^k spp, each
+// dimension must be stratified into 2^k equal intervals, and the first two
+// dimensions of each block of four (the pixel position, for the camera)
+// must form a (0, 2)-net; both unscrambled and as the sampler scrambles
+// them. The values the sampler hands out must be sobol_sample's.
+void check_sobol() {
+    int bad_strata = 0, bad_nets = 0, cases = 0;
+    for (int k = 0; k <= 8; k++) {
+        const uint32_t n = 1u << k;
+        for (uint32_t dim = 0; dim < 16; dim++) {
+            std::vector<uint32_t> x(n), y(n), sx(n), sy(n);
+            for (uint32_t seed = 0; seed < 4; seed++) {
+                for (uint32_t i = 0; i < n; i++) {
+                    x[i] = sobol(i, int(dim % 4));
+                    y[i] = sobol(i, int(dim % 4 + 1) % 4);
+                    sx[i] = sobol_sample(i, dim, seed * 7919, k);
+                    sy[i] = sobol_sample(i, dim + 1, seed * 7919, k);
+                }
+                bad_strata += !is_stratified(x, k) + !is_stratified(sx, k);
+                if (dim % 4 == 0)
+                    bad_nets += !is_net(x, y, k) + !is_net(sx, sy, k);
+                cases++;
+            }
+        }
+    }
+    expect(bad_strata == 0, "Sobol: " + std::to_string(bad_strata) + " dimensions of "
+        + std::to_string(cases) + " point sets are not stratified");
+    expect(bad_nets == 0, "Sobol: " + std::to_string(bad_nets) + " block-leading pairs are not (0, 2)-nets");
+
+    // The sampler caches the shuffle per block of four dimensions; what it
+    // returns must still match sobol_sample dimension by dimension.
+    const uint32_t spp = 16;
+    int wrong = 0;
+    for (uint64_t pixel = 0; pixel < 64; pixel++) {
+        for (uint32_t s = 0; s < spp; s++) {
+            seed_random(pixel, s, 3, sampler_sobol, spp);
+            const uint32_t pixel_seed = thread_sampler().pixel_seed;
+            for (uint32_t d = 0; d < camera_sample_dimensions; d++)
+                wrong += random_double() != sobol_sample(s, d, pixel_seed, 4) * (1.0 / 4294967296.0);
+            for (int depth = 0; depth < 3; depth++) {
+                thread_sampler().start_bounce(depth);
+                const uint32_t first = camera_sample_dimensions + uint32_t(depth) * bounce_sample_dimensions;
+                for (uint32_t d = first; d < first + bounce_sample_dimensions; d++)
+                    wrong += random_double() != sobol_sample(s, d, pixel_seed, 4) * (1.0 / 4294967296.0);
+            }
+        }
+    }
+    expect(wrong == 0, "Sobol sampler: " + std::to_string(wrong) + " values differ from sobol_sample");
+}
+
+int main() {
+    pcg32 rng(1, 2);
+    thread_pool pool(4);
+    constant_texture white_albedo(vec3(0.73, 0.73, 0.73));
+    constant_texture red_albedo(vec3(0.65, 0.05, 0.05));
+    lambertian white(&white_albedo);
+    lambertian red(&red_albedo);
+
+    // The large scene passes bvh_parallel_threshold, so it is built in
+    // parallel on the pool.
+    hittable_list small = random_scene(rng, 500, &white);
+    hittable_list large = random_scene(rng, 20000, &white);
+    check_bvh("SAH bvh_node", small, nullptr, rng, 4000);
+    check_bvh("parallel SAH bvh_node", large, &pool, rng, 1000);
+
+    check_obj();
+    check_obj_materials(&white, &red);
+    check_ply();
+    check_triangle_mesh(rng, &white);
+    check_mesh_file(rng, &white, &red);
+    check_light_power(rng, &white);
+    check_light_tree(rng, &white);
+    check_sobol();
+
+    std::cerr << (failures == 0 ? "All checks passed.\n" : "Some checks failed.\n");
+    return failures;
+}
@@ -0,0 +1,204 @@
+#pragma once
+#include "vec3.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+// Linear float RGB image. Rows are stored bottom-up, matching the j index
+// used by camera::get_ray, and the writers flip where a format wants the
+// top row first.
+class framebuffer {
+public:
+    framebuffer() {}
+    framebuffer(int w, int h) { resize(w, h); }
+
+    void resize(int w, int h) {
+        nx = w;
+        ny = h;
+        data.assign(size_t(w) * h * 3, 0.0f);
+    }
+
+    int width() const { return nx; }
+    int height() const { return ny; }
+    const float* pixels() const { return data.data(); }
+
+    void set(int i, int j, const vec3& c) {
+        float* p = &data[(size_t(j) * nx + i) * 3];
+        p[0] = float(c.x());
+        p[1] = float(c.y());
+        p[2] = float(c.z());
+    }
+    void add(int i, int j, const vec3& c) {
+        float* p = &data[(size_t(j) * nx + i) * 3];
+        p[0] += float(c.x());
+        p[1] += float(c.y());
+        p[2] += float(c.z());
+    }
+    vec3 get(int i, int j) const {
+        const float* p = &data[(size_t(j) * nx + i) * 3];
+        return vec3(p[0], p[1], p[2]);
+    }
+
+    // Scales, gamma corrects (gamma 2) and quantizes the whole buffer in
+    // one pass, returning 8-bit RGB with the top row first.
+    std::vector<unsigned char> to_rgb8(float scale) const {
+        std::vector<unsigned char> out(data.size());
+        const size_t row = size_t(nx) * 3;
+        for (int j = 0; j < ny; j++) {
+            const float* src = &data[size_t(ny - 1 - j) * row];
+            unsigned char* dst = &out[size_t(j) * row];
+            for (size_t k = 0; k < row; k++) {
+                float v = std::sqrt(std::fmax(src[k] * scale, 0.0f));
+                v = std::fmin(v, 0.999f);
+                dst[k] = static_cast<unsigned char>(256.0f * v);
+            }
+        }
+        return out;
+    }
+
+private:
+    int nx = 0;
+    int ny = 0;
+    std::vector<float> data;
+};
+
+// Binary PPM (P6).
+inline void write_ppm(std::ostream& out, const framebuffer& fb, float scale) {
+    std::vector<unsigned char> rgb = fb.to_rgb8(scale);
+    out << "P6\n" << fb.width() << ' ' << fb.height() << "\n255\n";
+    out.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+}
+
+// PFM keeps the linear float values. Its rows run bottom to top, like ours;
+// a negative scale marks little-endian data.
+inline void write_pfm(std::ostream& out, const framebuffer& fb, float scale) {
+    out << "PF\n" << fb.width() << ' ' << fb.height() << "\n-1.0\n";
+    std::vector<float> row(size_t(fb.width()) * 3);
+    for (int j = 0; j < fb.height(); j++) {
+        const float* src = fb.pixels() + size_t(j) * row.size();
+        for (size_t k = 0; k < row.size(); k++)
+            row[k] = src[k] * scale;
+        out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+    }
+}
+
+inline uint32_t png_crc(const unsigned char* buf, size_t len, uint32_t crc = 0) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++)
+        crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// PNG with an uncompressed (stored) deflate stream: no entropy coding, so
+// writing costs little more than a memcpy, at the price of a larger file.
+inline void write_png(std::ostream& out, const framebuffer& fb, float scale) {
+    std::vector<unsigned char> rgb = fb.to_rgb8(scale);
+    const size_t row = size_t(fb.width()) * 3;
+
+    std::vector<unsigned char> raw;
+    raw.reserve((row + 1) * fb.height());
+    for (int j = 0; j < fb.height(); j++) {
+        raw.push_back(0);   // filter type: none
+        raw.insert(raw.end(), rgb.begin() + j * row, rgb.begin() + (j + 1) * row);
+    }
+
+    std::vector<unsigned char> z;
+    z.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+    z.push_back(0x78);
+    z.push_back(0x01);
+    size_t pos = 0;
+    do {
+        size_t len = raw.size() - pos < 65535 ? raw.size() - pos : 65535;
+        z.push_back(pos + len == raw.size() ? 1 : 0);
+        z.push_back(len & 0xff);
+        z.push_back((len >> 8) & 0xff);
+        z.push_back(~len & 0xff);
+        z.push_back((~len >> 8) & 0xff);
+        z.insert(z.end(), raw.begin() + pos, raw.begin() + pos + len);
+        pos += len;
+    } while (pos < raw.size());
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < raw.size(); ) {
+        size_t end = i + 5552 < raw.size() ? i + 5552 : raw.size();
+        for (; i < end; i++) {
+            a += raw[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    uint32_t adler = (b << 16) | a;
+    for (int s = 24; s >= 0; s -= 8)
+        z.push_back((adler >> s) & 0xff);
+
+    auto put32 = [](std::vector<unsigned char>& v, uint32_t x) {
+        for (int s = 24; s >= 0; s -= 8)
+            v.push_back((x >> s) & 0xff);
+    };
+    auto chunk = [&](const char* type, const std::vector<unsigned char>& payload) {
+        std::vector<unsigned char> c;
+        put32(c, uint32_t(payload.size()));
+        c.insert(c.end(), type, type + 4);
+        c.insert(c.end(), payload.begin(), payload.end());
+        put32(c, png_crc(c.data() + 4, c.size() - 4));
+        out.write(reinterpret_cast<const char*>(c.data()), c.size());
+    };
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    out.write(reinterpret_cast<const char*>(signature), 8);
+    std::vector<unsigned char> ihdr;
+    put32(ihdr, fb.width());
+    put32(ihdr, fb.height());
+    ihdr.push_back(8);  // bit depth
+    ihdr.push_back(2);  // colour type: RGB
+    ihdr.push_back(0);
+    ihdr.push_back(0);
+    ihdr.push_back(0);
+    chunk("IHDR", ihdr);
+    chunk("IDAT", z);
+    chunk("IEND", std::vector<unsigned char>());
+}
+
+// Picks the format from the file extension (.png, .pfm, anything else is
+// P6). An empty path writes P6 to stdout.
+inline bool write_image(const std::string& path, const framebuffer& fb, float scale) {
+    if (path.empty()) {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        write_ppm(std::cout, fb, scale);
+        std::cout.flush();
+        return bool(std::cout);
+    }
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        std::cerr << "Could not open " << path << " for writing.\n";
+        return false;
+    }
+    std::string ext = path.size() >= 4 ? path.substr(path.size() - 4) : "";
+    if (ext == ".png")
+        write_png(out, fb, scale);
+    else if (ext == ".pfm")
+        write_pfm(out, fb, scale);
+    else
+        write_ppm(out, fb, scale);
+    return bool(out);
+}
@@ -3,7 +3,10 @@
 #include "texture.h"
 #include "ray.h"
 #include "onb.h"
-#include "pdf.h"
+#include "arena.h"
+#include <map>
+#include <string>
+#include <vector>
 class aabb {
 public:
     aabb() {}
@@ -11,20 +14,32 @@ public:
 
     vec3 min() const { return _min; }
     vec3 max() const { return _max; }
+    vec3 centroid() const { return 0.5 * (_min + _max); }
+
+    double surface_area() const {
+        vec3 d = _max - _min;
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
 
-    bool hit(const ray& r, double tmin, double tmax) const {
+    // Branchless slab test. The ray's sign bits pick the near and far
+    // planes per axis, so no swap is needed; the comparisons are written so
+    // a NaN slab distance (origin on a plane, zero direction) is ignored.
+    // Far distances are scaled up by a few ulps to cover rounding (Ize,
+    // "Robust BVH Ray Traversal"), so a ray through an edge shared by two
+    // boxes cannot pass between them.
+    bool hit(const ray& r, double t_min, double t_max) const {
+        const real pad = 1 + 4 * std::numeric_limits<real>::epsilon();
+        const vec3& o = r.origin();
+        const vec3& inv = r.inv_direction();
+        real tmin = real(t_min);
+        real tmax = real(t_max);
         for (int a = 0; a < 3; a++) {
-            auto invD = 1.0f / r.direction()[a];
-            auto t0 = (min()[a] - r.origin()[a]) * invD;
-            auto t1 = (max()[a] - r.origin()[a]) * invD;
-            if (invD < 0.0f)
-                std::swap(t0, t1);
+            real t0 = ((r.sign[a] ? _max : _min)[a] - o[a]) * inv[a];
+            real t1 = ((r.sign[a] ? _min : _max)[a] - o[a]) * inv[a] * pad;
             tmin = t0 > tmin ? t0 : tmin;
             tmax = t1 < tmax ? t1 : tmax;
-            if (tmax <= tmin)
-                return false;
         }
-        return true;
+        return tmin < tmax;
     }
 
     vec3 _min;
@@ -35,10 +50,10 @@ class material;
 struct hit_record {
 	vec3 hittedPoint;
 	vec3 normal;
-    shared_ptr<material> mat_ptr;
-    double t;
-    double u;
-    double v;
+    material* mat_ptr;
+    real t;
+    real u;
+    real v;
     bool front_face;
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
@@ -49,18 +64,66 @@ struct hit_record {
 class hittable {
 public:
 	virtual bool hit(const ray& r,double t_min,double t_max,hit_record& rec) const = 0;
+    // Closest-hit test in two steps, so a collection builds the record only
+    // for its final hit: deferred_hit() finds t and surface() then fills in
+    // rec for the winner. Shapes without a cheaper t-only test fill rec in
+    // deferred_hit() and have nothing left to do in surface().
+    virtual bool deferred_hit(const ray& r, double t_min, double t_max, real& t, hit_record& rec) const {
+        if (!hit(r, t_min, t_max, rec))
+            return false;
+        t = rec.t;
+        return true;
+    }
+    virtual void surface(const ray& r, real t, hit_record& rec) const {}
+    // Any-hit visibility query: true if anything lies on the ray within
+    // (t_min, t_max). Stops at the first hit and fills in no hit record.
+    virtual bool occluded(const ray& r, double t_min, double t_max) const {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const = 0;
     virtual float pdf_value(const vec3& o, const vec3& v) const { return 0.0; }
     virtual vec3 random(const vec3& o) const { return vec3(1, 0, 0);}
+    // Surface area, for weighting lights by power; 0 if unknown.
+    virtual double area() const { return 0; }
+    // Light sampling as seen from a surface point o with normal n.
+    // Collections of lights can use n to prefer lights the surface faces;
+    // single shapes ignore it.
+    virtual float surface_pdf_value(const vec3& o, const vec3& n, const vec3& v) const {
+        return pdf_value(o, v);
+    }
+    virtual vec3 surface_random(const vec3& o, const vec3& n) const { return random(o); }
+    // surface_random and surface_pdf_value of the chosen direction in one
+    // call. Shapes that know the pdf of their own samples in closed form
+    // override it to skip the second query.
+    virtual vec3 sample_direction(const vec3& o, const vec3& n, float& pdf) const {
+        vec3 v = surface_random(o, n);
+        pdf = surface_pdf_value(o, n, v);
+        return v;
+    }
 };
+// pdf.h needs the complete hittable class for hittable_pdf.
+#include "pdf.h"
 struct scatter_record {
     ray specular_ray;
     bool is_specular;
     vec3 attenuation;
     pdf* pdf_ptr;
 };
+// Concrete material type, so batched shading can group hits by material
+// and call each kind's methods without virtual dispatch.
+enum material_kind {
+    material_other,
+    material_lambertian,
+    material_metal,
+    material_dielectric,
+    material_diffuse_light,
+    material_kind_count
+};
+
 class material {
 public:
+    material(material_kind k = material_other) : kind(k) {}
     virtual bool scatter(
         const ray& r_in,  hit_record& hrec, scatter_record& srec) const = 0;
     virtual float scattering_pdf(const ray& r_in, hit_record& rec, ray& scattered) {
@@ -69,11 +132,14 @@ public:
     virtual vec3 emitted(const ray& r_in, const hit_record& rec,double u, double v, const vec3& p) const {
         return vec3(0, 0, 0);
     }
+
+public:
+    material_kind kind;
 };
 
-class lambertian :public material {
+class lambertian final :public material {
 public:
-    lambertian( texture* a) : albedo(a) {}
+    lambertian( texture* a) : material(material_lambertian), albedo(a) {}
     virtual float scattering_pdf(const ray& r_in, hit_record& rec, ray& scattered) {
         float cosine = dot(rec.normal, unit_vector(scattered.direction()));
         if (cosine < 0) cosine = 0;
@@ -93,15 +159,15 @@ public:
         */
         srec.is_specular = false;
         srec.attenuation = albedo->value(hrec.u, hrec.v, hrec.hittedPoint);
-        srec.pdf_ptr = new cosine_pdf(hrec.normal);
+        srec.pdf_ptr = thread_arena().make<cosine_pdf>(hrec.normal);
         return true;
     }
 public:
     texture* albedo;
 };
-class metal :public material {
+class metal final :public material {
 public:
-    metal(const vec3& a , double f) : albedo(a),fuzz(f < 1 ? f : 1) {}
+    metal(const vec3& a , double f) : material(material_metal), albedo(a),fuzz(f < 1 ? f : 1) {}
 
     virtual bool scatter(
         const ray& r_in, hit_record& hrec, scatter_record& srec
@@ -121,14 +187,16 @@ public:
 
 };
 
-class dielectric : public material {
+class dielectric final : public material {
 public:
-    dielectric(double ri) : ref_idx(ri) {}
+    dielectric(double ri) : material(material_dielectric), ref_idx(ri) {}
 
     virtual bool scatter(
-        const ray& r_in,  hit_record& rec, vec3& attenuation, ray& scattered, float& pdf
+        const ray& r_in,  hit_record& rec, scatter_record& srec
     ) const {
-        attenuation = vec3(1.0, 1.0, 1.0);
+        srec.is_specular = true;
+        srec.pdf_ptr = 0;
+        srec.attenuation = vec3(1.0, 1.0, 1.0);
         double etai_over_etat = (rec.front_face) ? (1.0 / ref_idx) : (ref_idx);
 
         vec3 unit_direction = unit_vector(r_in.direction());
@@ -136,18 +204,18 @@ public:
         double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
         if (etai_over_etat * sin_theta > 1.0) {
             vec3 reflected = reflect(unit_direction, rec.normal);
-            scattered = ray(rec.hittedPoint, reflected);
+            srec.specular_ray = ray(rec.hittedPoint, reflected, r_in.time());
             return true;
         }
         double reflect_prob = schlick(cos_theta, etai_over_etat);
         if (random_double() < reflect_prob)
         {
             vec3 reflected = reflect(unit_direction, rec.normal);
-            scattered = ray(rec.hittedPoint, reflected);
+            srec.specular_ray = ray(rec.hittedPoint, reflected, r_in.time());
             return true;
         }
         vec3 refracted = refract(unit_direction, rec.normal, etai_over_etat);
-        scattered = ray(rec.hittedPoint, refracted);
+        srec.specular_ray = ray(rec.hittedPoint, refracted, r_in.time());
         return true;
     }
 
@@ -171,12 +239,12 @@ public:
 };
 */
 
-class diffuse_light : public material {
+class diffuse_light final : public material {
 public:
-    diffuse_light(texture* a) : emit(a) {}
+    diffuse_light(texture* a) : material(material_diffuse_light), emit(a) {}
 
     virtual bool scatter(
-        const ray& r_in, hit_record& rec, vec3& attenuation, ray& scattered, float& pdf
+        const ray& r_in, hit_record& rec, scatter_record& srec
     ) const {
         return false;
     }
@@ -192,5 +260,29 @@ public:
     texture* emit;
 };
 
+// Scene-owned storage for materials. Primitives and hit records refer to
+// materials through the raw handles returned by add(), so intersection
+// code never touches a reference count. Materials added with a name can be
+// looked up by it, as mesh files refer to them.
+class material_table {
+public:
+    material* add(shared_ptr<material> m) {
+        materials.push_back(m);
+        return m.get();
+    }
+    material* add(shared_ptr<material> m, const std::string& name) {
+        return named[name] = add(m);
+    }
+    // The material added as name, or null.
+    material* find(const std::string& name) const {
+        auto it = named.find(name);
+        return it == named.end() ? nullptr : it->second;
+    }
+    size_t size() const { return materials.size(); }
+
+public:
+    std::vector<shared_ptr<material>> materials;
+    std::map<std::string, material*> named;
+};
 
 #endif
\ No newline at end of file
@@ -21,25 +21,35 @@ public:
     }
     
    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const ;
+   virtual bool occluded(const ray& r, double t_min, double t_max) const;
    virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
    virtual float pdf_value(const vec3& o, const vec3& v) const;
    virtual vec3 random(const vec3& o) const;
 public:
     std::vector<shared_ptr<hittable>> objects;
 };
+// Only the closest t and object are tracked; the winner's surface() fills
+// in the hit record once, after the loop.
 bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    double closest_so_far = t_max;
-    hit_record temp_rec ;
-    bool hit_anything = false;
+    const hittable* closest = nullptr;
+    real closest_t = real(t_max);
+    real t;
     for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
-            closest_so_far = temp_rec.t;
-            hit_anything = true;
-            rec = temp_rec;
+        if (object->deferred_hit(r, t_min, closest_t, t, rec)) {
+            closest_t = t;
+            closest = object.get();
         }
-    
     }
-    return hit_anything;
+    if (!closest)
+        return false;
+    closest->surface(r, closest_t, rec);
+    return true;
+}
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const {
+    for (const auto& object : objects)
+        if (object->occluded(r, t_min, t_max))
+            return true;
+    return false;
 }
 float hittable_list::pdf_value(const vec3& o, const vec3& v) const {
     float weight = 1.0 / objects.size();
@@ -77,12 +87,15 @@ bool hittable_list::bounding_box(double t0, double t1, aabb& output_box) const {
     return true;
 }
 
-class box : public hittable {
+class box final : public hittable {
 public:
     box() {}
-    box(const vec3& p0, const vec3& p1, shared_ptr<material> ptr);
+    box(const vec3& p0, const vec3& p1, material* ptr);
 
     virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double t0, double t1) const {
+        return sides.occluded(r, t0, t1);
+    }
 
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
         output_box = aabb(box_min, box_max);
@@ -95,7 +108,7 @@ public:
     hittable_list sides;
 };
 
-box::box(const vec3& p0, const vec3& p1, shared_ptr<material> ptr) {
+box::box(const vec3& p0, const vec3& p1, material* ptr) {
     box_min = p0;
     box_max = p1;
 
@@ -117,12 +130,15 @@ bool box::hit(const ray& r, double t0, double t1, hit_record& rec) const {
 }
 
 
-class translate : public hittable {
+class translate final : public hittable {
 public:
     translate(shared_ptr<hittable> p, const vec3& displacement)
         : ptr(p), offset(displacement) {}
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const {
+        return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+    }
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
 
 public:
@@ -152,15 +168,19 @@ bool translate::bounding_box(double t0, double t1, aabb& output_box) const {
     return true;
 }
 
-class rotate_y : public hittable {
+class rotate_y final : public hittable {
 public:
     rotate_y(shared_ptr<hittable> p, double angle);
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const {
+        return ptr->occluded(rotate(r), t_min, t_max);
+    }
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
         output_box = bbox;
         return hasbox;
     }
+    ray rotate(const ray& r) const;
 
 public:
     shared_ptr<hittable> ptr;
@@ -202,7 +222,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
     bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+ray rotate_y::rotate(const ray& r) const {
     vec3 origin = r.origin();
     vec3 direction = r.direction();
 
@@ -212,7 +232,11 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
     direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
+    return ray(origin, direction, r.time());
+}
+
+bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    ray rotated_r = rotate(r);
 
     if (!ptr->hit(rotated_r, t_min, t_max, rec))
         return false;
@@ -1,19 +1,32 @@
 ﻿#include "rtweekend.h"
 #include "camera.h"
-#include "hittable_list.h"
+#include "hittable_List.h"
 #include "bvh.h"
 #include "rectangle.h"
 #include "sphere.h"
+#include "render.h"
+#include "integrator.h"
+#include "light.h"
+#include "mesh_file.h"
+#include "packet.h"
+#include "wavefront.h"
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
 #include <iostream>
+#include <string>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
-hittable_list cornell_box() {
+// Radiance of the ceiling light, shared by its material and the light list.
+const vec3 cornell_light_radiance(15, 15, 15);
+
+hittable_list cornell_box(material_table& materials) {
     hittable_list objects;
 
-    auto red = make_shared<lambertian>(new constant_texture(vec3(0.65, 0.05, 0.05)));
-    auto white = make_shared<lambertian>(new constant_texture(vec3(0.73, 0.73, 0.73)));
-    auto green = make_shared<lambertian>(new constant_texture(vec3(0.12, 0.45, 0.15)));
-    auto light = make_shared<diffuse_light>(new constant_texture(vec3(15, 15, 15)));
+    auto red = materials.add(make_shared<lambertian>(new constant_texture(vec3(0.65, 0.05, 0.05))), "red");
+    auto white = materials.add(make_shared<lambertian>(new constant_texture(vec3(0.73, 0.73, 0.73))), "white");
+    auto green = materials.add(make_shared<lambertian>(new constant_texture(vec3(0.12, 0.45, 0.15))), "green");
+    auto light = materials.add(make_shared<diffuse_light>(new constant_texture(cornell_light_radiance)), "light");
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
@@ -33,26 +46,26 @@ hittable_list cornell_box() {
     objects.add(box2);
     return objects;
 }
-hittable_list earth() {
+hittable_list earth(material_table& materials) {
     int nx, ny, nn;
     unsigned char* texture_data = stbi_load("C:/Users/Administrator/Pictures/earth.jpg", &nx, &ny, &nn, 0);
 
     auto earth_surface =
-        make_shared<lambertian>(new image_texture(texture_data, nx, ny));
+        materials.add(make_shared<lambertian>(new image_texture(texture_data, nx, ny)));
     auto globe = make_shared<sphere>(vec3(0, 0, 0), 2, earth_surface);
 
     return hittable_list(globe);
 }
-hittable_list two_perlin_spheres() {
+hittable_list two_perlin_spheres(material_table& materials) {
     hittable_list objects;
 
     auto pertext = new noise_texture();
-    objects.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(vec3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+    objects.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, materials.add(make_shared<lambertian>(pertext))));
+    objects.add(make_shared<sphere>(vec3(0, 2, 0), 2, materials.add(make_shared<lambertian>(pertext))));
 
     return objects;
 }
-bvh_node random_scene() {
+bvh_node random_scene(material_table& materials, thread_pool* pool = nullptr) {
     hittable_list world;
     
    
@@ -64,7 +77,7 @@ bvh_node random_scene() {
     //texture* checker = new checker_texture(new constant_texture(vec3(0.2, 0.3, 0.1)),
       //  new constant_texture(vec3(0.9, 0.9, 0.9)));
     
-    world.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    world.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, materials.add(make_shared<lambertian>(checker))));
     
     //world.add(make_shared<sphere>(
        // vec3(0, -1000, 0), 1000, make_shared<lambertian>(vec3(0.5, 0.5, 0.5))));
@@ -77,32 +90,32 @@ bvh_node random_scene() {
             if ((center - vec3(4, .2, 0)).length() > 0.9) {
                 if (choose_mat < 0.8) {
                     // diffuse
-                    auto albedo = random() * random();
+                    auto albedo = vec3::random() * vec3::random();
                     world.add(make_shared<moving_sphere>(
                         center, center + vec3(0, random_double(0, .5), 0), 0.0, 1.0, 0.2,
-                        make_shared<lambertian>(new constant_texture(albedo))));
+                        materials.add(make_shared<lambertian>(new constant_texture(albedo)))));
                 }
                 else if (choose_mat < 0.95) {
                     // metal
-                    auto albedo = random(.5, 1);
+                    auto albedo = vec3::random(.5, 1);
                     auto fuzz = random_double(0, .5);
                     world.add(
-                        make_shared<sphere>(center, 0.2, make_shared<metal>(albedo, fuzz)));
+                        make_shared<sphere>(center, 0.2, materials.add(make_shared<metal>(albedo, fuzz))));
                 }
                 else {
                     // glass
-                    world.add(make_shared<sphere>(center, 0.2, make_shared<dielectric>(1.5)));
+                    world.add(make_shared<sphere>(center, 0.2, materials.add(make_shared<dielectric>(1.5))));
                 }
             }
         }
     }
 
-    world.add(make_shared<sphere>(vec3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+    world.add(make_shared<sphere>(vec3(0, 1, 0), 1.0, materials.add(make_shared<dielectric>(1.5))));
     world.add(make_shared<sphere>(
-        vec3(-4, 1, 0), 1.0, make_shared<lambertian>(new constant_texture(vec3(0.4, 0.2, 0.1)))));
+        vec3(-4, 1, 0), 1.0, materials.add(make_shared<lambertian>(new constant_texture(vec3(0.4, 0.2, 0.1))))));
     world.add(make_shared<sphere>(
-        vec3(4, 1, 0), 1.0, make_shared<metal>(vec3(0.7, 0.6, 0.5), 0.0)));
-     return bvh_node(world, 0, 1);
+        vec3(4, 1, 0), 1.0, materials.add(make_shared<metal>(vec3(0.7, 0.6, 0.5), 0.0))));
+     return bvh_node(world, 0, 1, pool);
     // return world;
 }
 /*
@@ -163,45 +176,103 @@ vec3 ray_color(const ray& r, const vec3& background, const hittable& world, int
     //return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
 }
 */
-vec3 ray_color(const ray& r, const hittable& world,hittable*light_shape,int depth) {
-    hit_record hrec;
-
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0)
-        return vec3(0, 0, 0);
+// Parses all of s as a decimal int.
+bool parse_int(const char* s, int& out) {
+    char* end;
+    errno = 0;
+    long v = std::strtol(s, &end, 10);
+    if (end == s || *end != '\0' || errno == ERANGE || v < INT_MIN || v > INT_MAX)
+        return false;
+    out = int(v);
+    return true;
+}
 
-    // If the ray hits nothing, return the background color.
-    if (world.hit(r, 0.001, infinity, hrec)) {
-        scatter_record srec;
-        vec3 emitted = hrec.mat_ptr->emitted(r, hrec, hrec.u, hrec.v, hrec.hittedPoint);
-        float pdf_val;
-        vec3 albedo;
-        if (hrec.mat_ptr->scatter(r, hrec, srec)) {
-            if (srec.is_specular) {
-                return srec.attenuation * ray_color(srec.specular_ray, world, light_shape, depth - 1);
-            }
+int main(int argc, char** argv) {
+    render_options opt;
+    std::string mesh_path;
+    std::string save_mesh_path;
+    for (int a = 1; a < argc; a += 2) {
+        std::string flag = argv[a];
+        if (a + 1 == argc) {
+            std::cerr << "Missing value for " << flag << "\n";
+            return 1;
+        }
+        // Numeric options must parse completely and be at least min.
+        auto number = [&](int min, int& out) {
+            if (parse_int(argv[a + 1], out) && out >= min)
+                return true;
+            std::cerr << "Invalid value '" << argv[a + 1] << "' for " << flag;
+            if (min > 0)
+                std::cerr << " (must be a positive integer)";
+            std::cerr << "\n";
+            return false;
+        };
+        int value = 0;
+        bool ok = true;
+        if (flag == "-o" || flag == "--output") opt.output = argv[a + 1];
+        else if (flag == "-t" || flag == "--threads") { if ((ok = number(1, value))) opt.threads = value; }
+        else if (flag == "-s" || flag == "--spp") ok = number(1, opt.samples_per_pixel);
+        else if (flag == "--tile") ok = number(1, opt.tile_size);
+        else if (flag == "--seed") { if ((ok = number(0, value))) opt.seed = value; }
+        else if (flag == "--depth") ok = number(0, opt.max_depth);
+        else if (flag == "--rr-depth") ok = number(0, opt.rr_start_depth);
+        else if (flag == "--packets") ok = number(0, opt.packet_size);
+        else if (flag == "--wavefront") { if ((ok = number(0, value))) opt.wavefront = value != 0; }
+        else if (flag == "--mesh") mesh_path = argv[a + 1];
+        else if (flag == "--save-mesh") save_mesh_path = argv[a + 1];
+        else if (flag == "--sampler") {
+            std::string name = argv[a + 1];
+            if (name == "independent") opt.sampler = sampler_independent;
+            else if (name == "sobol") opt.sampler = sampler_sobol;
+            else if (name == "blue-noise") opt.sampler = sampler_blue_noise;
             else {
-             
-                hittable_pdf p0(light_shape, hrec.hittedPoint);
-                mixture_pdf p(&p0, srec.pdf_ptr);
-                ray scattered = ray(hrec.hittedPoint, p.generate(), r.time());
-                pdf_val = p.value(scattered.direction());
-                return emitted + albedo * hrec.mat_ptr->scattering_pdf(r, hrec, scattered) * ray_color(scattered, world, light_shape, depth - 1) / pdf_val;
+                std::cerr << "Unknown sampler '" << name << "' (expected independent, sobol or blue-noise)\n";
+                ok = false;
             }
         }
-        else
-            return emitted;
+        else {
+            std::cerr << "Unknown option " << flag << "\n";
+            ok = false;
+        }
+        if (!ok)
+            return 1;
     }
-    //return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
-}
-int main() {
-    auto world = cornell_box();
-    const int image_width = 1280;
-    const int image_height = 720;
-    const int samples_per_pixel = 5;
-    int depth = 15;
-    vec3 background(0, 0, 0);
-    const auto aspect_ratio = double(image_width) / image_height;
+
+    thread_pool pool(opt.threads);
+    material_table materials;
+    auto world = cornell_box(materials);
+    if (!mesh_path.empty()) {
+        auto white = materials.find("white");
+        shared_ptr<triangle_mesh> mesh;
+        std::vector<std::string> material_names;
+        if (mesh_path.size() >= 4 && mesh_path.substr(mesh_path.size() - 4) == ".rtm") {
+            mesh_file mf;
+            if (!open_mesh_file(mesh_path, mf))
+                return 1;
+            material_names = mf.material_names;
+            mesh = make_shared<triangle_mesh>(mf.view, mf.nodes, mf.node_count, white, mf.file, &pool);
+        }
+        else {
+            mesh_data data;
+            if (!load_mesh(mesh_path, data))
+                return 1;
+            material_names = data.material_names;
+            mesh = make_shared<triangle_mesh>(std::move(data), white, &pool);
+        }
+        std::cerr << "Loaded " << mesh->triangle_count() << " triangles from " << mesh_path << "\n";
+        // usemtl names pick scene materials by name; unknown names stay white.
+        mesh->materials.assign(material_names.size(), white);
+        for (size_t k = 0; k < material_names.size(); k++) {
+            if (material* m = materials.find(material_names[k]))
+                mesh->materials[k] = m;
+            else
+                std::cerr << "No material named " << material_names[k] << ", using white.\n";
+        }
+        if (!save_mesh_path.empty() && !write_mesh_file(save_mesh_path, *mesh, material_names))
+            return 1;
+        world.add(mesh);
+    }
+    const auto aspect_ratio = double(opt.image_width) / opt.image_height;
     vec3 lookfrom(278, 278, -800);
     vec3 lookat(278, 278, 0);
     vec3 vup(0, 1, 0);
@@ -210,23 +281,37 @@ int main() {
     auto vfov = 40.0;
 
     camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
-     hittable* light_shape = new xz_rect (213, 343, 227, 332, 554, 0);
-     hittable* glass_sphere = new sphere (vec3(190, 90, 190), 90, 0);
-     hittable_list* hlist = new hittable_list();
-     hlist->add(light_shape);
-    std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-    for (int j = image_height - 1; j >= 0; j--) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-        for (int i = 0; i < image_width; i++) {
-            vec3 color(0,0,0);
-                for (int s = 0; s < samples_per_pixel; ++s) {
-                    auto x = (i+random_double()) / image_width;
-                    auto y = (j+random_double()) / image_height;
-                    ray r = cam.get_ray(x, y);
-                    color += ray_color(r,world,hlist,10);
-                }
-            color.write_color(std::cout,samples_per_pixel);
-        }
+    shared_ptr<hittable> light_shape = make_shared<xz_rect>(213, 343, 227, 332, 554, nullptr);
+    shared_ptr<hittable> glass_sphere = make_shared<sphere>(vec3(190, 90, 190), 90, nullptr);
+    light_list* lights = new light_list();
+    lights->add(light_shape, cornell_light_radiance);
+    lights->build();
+
+    std::cerr << "Rendering with " << pool.size() << " threads\n";
+    framebuffer fb;
+    if (opt.wavefront) {
+        render_wavefront(pool, opt, fb, cam, world, lights);
+    }
+    else if (opt.packet_size > 0) {
+        bvh_node scene(world, 0, 1, &pool);
+        render_packets(pool, opt, fb, cam, scene, lights);
+    }
+    else {
+        render_tiles(pool, opt, fb, [&](int i, int j) {
+            vec3 color(0, 0, 0);
+            for (int s = 0; s < opt.samples_per_pixel; ++s) {
+                start_pixel_sample(i, j, s, opt);
+                auto x = (i + random_double()) / opt.image_width;
+                auto y = (j + random_double()) / opt.image_height;
+                ray r = cam.get_ray(x, y);
+                color += ray_color(r, world, lights, opt);
+                thread_arena().reset();
+            }
+            return color;
+        });
     }
+
+    if (!write_image(opt.output, fb, 1.0f / opt.samples_per_pixel))
+        return 1;
     std::cerr << "\nDone.\n";
-}
\ No newline at end of file
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "hittable.h"
+#include "render.h"
+
+// Iterative path tracer. Throughput is carried along the path instead of
+// being multiplied back up a recursion, and once a path is rr_start_depth
+// bounces long it is stopped with probability 1 - q, where q follows the
+// remaining throughput. Survivors are reweighted by 1 / q, which keeps the
+// estimate unbiased while dim paths stop early.
+//
+// This overload continues a path whose first intersection (over
+// [0.001, infinity)) was already found, as packet traversal does for
+// primary rays.
+inline vec3 ray_color(ray r, bool hit, hit_record hrec, const hittable& world, hittable* lights,
+    const render_options& opt) {
+    vec3 radiance(0, 0, 0);
+    vec3 throughput(1, 1, 1);
+
+    for (int depth = 0; depth < opt.max_depth; depth++) {
+        if (depth > 0)
+            hit = world.hit(r, 0.001, infinity, hrec);
+        if (!hit) {
+            radiance += throughput * opt.background;
+            break;
+        }
+
+        radiance += throughput * hrec.mat_ptr->emitted(r, hrec, hrec.u, hrec.v, hrec.hittedPoint);
+        thread_sampler().start_bounce(depth);
+
+        scatter_record srec;
+        if (!hrec.mat_ptr->scatter(r, hrec, srec))
+            break;
+
+        if (srec.is_specular) {
+            throughput = throughput * srec.attenuation;
+            r = srec.specular_ray;
+        }
+        else {
+            hittable_pdf light_pdf(lights, hrec.hittedPoint, hrec.normal);
+            mixture_pdf p(&light_pdf, srec.pdf_ptr);
+            float pdf_val;
+            ray scattered = ray(hrec.hittedPoint, p.sample(pdf_val), r.time());
+            if (!(pdf_val > 0))
+                break;
+            throughput = throughput * srec.attenuation
+                * hrec.mat_ptr->scattering_pdf(r, hrec, scattered) / pdf_val;
+            r = scattered;
+        }
+
+        if (depth + 1 >= opt.rr_start_depth) {
+            double q = ffmin(0.95, ffmax(throughput.x(), ffmax(throughput.y(), throughput.z())));
+            if (random_double() >= q)
+                break;
+            throughput /= q;
+        }
+    }
+    return radiance;
+}
+
+inline vec3 ray_color(const ray& r, const hittable& world, hittable* lights, const render_options& opt) {
+    hit_record hrec;
+    bool hit = world.hit(r, 0.001, infinity, hrec);
+    return ray_color(r, hit, hrec, world, lights, opt);
+}
@@ -1 +1,467 @@
 #pragma once
+#include "bvh.h"
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+inline double luminance(const vec3& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// Walker/Vose alias table: draws index i with probability weight[i] / sum
+// in constant time from a single uniform number.
+class alias_table {
+public:
+    // Weights must be non-negative; if they sum to zero every index is
+    // equally likely.
+    void build(const std::vector<double>& weights);
+
+    size_t sample(double u) const {
+        if (bins.empty())
+            return 0;
+        double x = u * bins.size();
+        size_t i = size_t(x);
+        if (i >= bins.size())
+            i = bins.size() - 1;
+        return x - i < bins[i].threshold ? i : bins[i].alias;
+    }
+
+    float pmf(size_t i) const { return bins[i].pmf; }
+    size_t size() const { return bins.size(); }
+
+private:
+    struct bin {
+        float threshold;    // keep i if the fractional part is below this
+        uint32_t alias;
+        float pmf;
+    };
+    std::vector<bin> bins;
+};
+
+void alias_table::build(const std::vector<double>& weights) {
+    const size_t n = weights.size();
+    bins.assign(n, bin{ 1, 0, 0 });
+    if (n == 0)
+        return;
+    double sum = 0;
+    for (double w : weights)
+        sum += w;
+
+    // Scaled so the mean is 1; bins below it are topped up from bins above.
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < n; i++) {
+        double p = sum > 0 ? weights[i] / sum : 1.0 / n;
+        bins[i].pmf = float(p);
+        bins[i].alias = uint32_t(i);
+        scaled[i] = p * n;
+        (scaled[i] < 1 ? small : large).push_back(uint32_t(i));
+    }
+    while (!small.empty() && !large.empty()) {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+        bins[s].threshold = float(scaled[s]);
+        bins[s].alias = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Whatever is left is 1 up to rounding.
+    for (uint32_t i : small)
+        bins[i].threshold = 1;
+    for (uint32_t i : large)
+        bins[i].threshold = 1;
+}
+
+// cos(max(0, a - b)) from the sines and cosines of a and b.
+inline double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+    if (cos_a > cos_b)
+        return 1;
+    return cos_a * cos_b + sin_a * sin_b;
+}
+
+inline double sin_from_cos(double c) {
+    return std::sqrt(ffmax(0.0, 1 - c * c));
+}
+
+// Angle between two unit vectors, accurate near 0 and pi.
+inline double angle_between(const vec3& a, const vec3& b) {
+    if (dot(a, b) < 0)
+        return pi - 2 * std::asin(ffmin(1.0, (a + b).length() / 2));
+    return 2 * std::asin(ffmin(1.0, (b - a).length() / 2));
+}
+
+// What a light or a group of lights looks like from afar: where it is, how
+// much it emits, and which way. Emitting surfaces have normals within
+// theta_o of axis and emit up to theta_e beyond them; two-sided emitters
+// use theta_o = pi.
+struct light_bounds {
+    aabb box;
+    vec3 axis;
+    double phi = 0;             // power
+    double cos_theta_o = -1;
+    double cos_theta_e = 0;
+
+    // Upper bound on the contribution to a point p with normal n (zero if
+    // there is no surface), following pbrt's light BVH: the cone of
+    // emission is widened by the angle the box subtends from p.
+    double importance(const vec3& p, const vec3& n) const;
+};
+
+double light_bounds::importance(const vec3& p, const vec3& n) const {
+    if (phi <= 0)
+        return 0;
+    const vec3 pc = box.centroid();
+    const double radius2 = (box.max() - box.min()).length_squared() / 4;
+    const double d2 = (p - pc).length_squared();
+    if (d2 <= radius2)
+        return phi / ffmax(radius2, 1e-12);
+
+    const vec3 wi = (p - pc) / std::sqrt(d2);
+    const double cos_b = std::sqrt(1 - radius2 / d2);
+    const double sin_b = sin_from_cos(cos_b);
+    const double cos_w = dot(axis, wi);
+    const double cos_x = cos_sub_clamped(sin_from_cos(cos_w), cos_w, sin_from_cos(cos_theta_o), cos_theta_o);
+    const double cos_p = cos_sub_clamped(sin_from_cos(cos_x), cos_x, sin_b, cos_b);
+    if (cos_p <= cos_theta_e)
+        return 0;
+    double importance = phi * cos_p / d2;
+    if (n.length_squared() > 0) {
+        const double cos_i = std::fabs(dot(wi, n));
+        importance *= cos_sub_clamped(sin_from_cos(cos_i), cos_i, sin_b, cos_b);
+    }
+    return ffmax(importance, 0.0);
+}
+
+inline light_bounds surrounding_bounds(const light_bounds& a, const light_bounds& b) {
+    if (a.phi <= 0)
+        return b;
+    if (b.phi <= 0)
+        return a;
+    light_bounds u;
+    u.box = surrounding_box(a.box, b.box);
+    u.phi = a.phi + b.phi;
+    u.cos_theta_e = ffmin(a.cos_theta_e, b.cos_theta_e);
+
+    // Smallest cone around both normal cones.
+    const double theta_a = std::acos(a.cos_theta_o), theta_b = std::acos(b.cos_theta_o);
+    const double theta_d = angle_between(a.axis, b.axis);
+    if (ffmin(theta_d + theta_b, pi) <= theta_a) {
+        u.axis = a.axis;
+        u.cos_theta_o = a.cos_theta_o;
+        return u;
+    }
+    if (ffmin(theta_d + theta_a, pi) <= theta_b) {
+        u.axis = b.axis;
+        u.cos_theta_o = b.cos_theta_o;
+        return u;
+    }
+    const double theta_o = (theta_a + theta_d + theta_b) / 2;
+    const vec3 k = cross(a.axis, b.axis);
+    if (theta_o >= pi || k.length_squared() == 0) {
+        u.axis = a.axis;
+        u.cos_theta_o = -1;
+        return u;
+    }
+    // Rotate a's axis towards b's by theta_o - theta_a (Rodrigues).
+    const vec3 w = unit_vector(k);
+    const double theta_r = theta_o - theta_a;
+    u.axis = unit_vector(a.axis * std::cos(theta_r) + cross(w, a.axis) * std::sin(theta_r)
+        + w * dot(w, a.axis) * (1 - std::cos(theta_r)));
+    u.cos_theta_o = std::cos(theta_o);
+    return u;
+}
+
+// Emitters for next-event estimation, used in place of a hittable_list of
+// light shapes. pdf_value only asks the lights the direction actually
+// passes, found through a BVH over their bounds.
+//
+// The same BVH, with light_bounds for every node, is the light hierarchy
+// used when sampling from a surface point: surface_random walks down it,
+// picking each child in proportion to its importance for the point and
+// normal, so the cost is logarithmic in the number of lights and far-away
+// or back-facing groups are rarely chosen. Without a surface, or where no
+// light matters at all, lights are chosen in proportion to their power
+// (area times luminance of the emitted radiance) through an alias table.
+// Either way one uniform number is used per choice.
+//
+// Shapes must implement pdf_value, random and area. Call build() after the
+// last add() and before rendering. An empty list samples zero directions
+// with pdf 0.
+class light_list : public hittable {
+public:
+    // facing, if non-zero, marks a one-sided emitter that only lights the
+    // hemisphere around it.
+    void add(shared_ptr<hittable> shape, const vec3& radiance, const vec3& facing = vec3(0, 0, 0)) {
+        shapes.push_back(shape);
+        power.push_back(shape->area() * ffmax(0.0, luminance(radiance)));
+        this->facing.push_back(facing);
+    }
+
+    void build();
+
+    size_t size() const { return shapes.size(); }
+    // Probability that random() picks light i.
+    float pmf(size_t i) const { return table.pmf(i); }
+    // Probability that surface_random(o, n) picks light i.
+    double pmf(size_t i, const vec3& o, const vec3& n) const;
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+    virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
+        output_box = tree.bounds();
+        return !shapes.empty();
+    }
+    virtual float pdf_value(const vec3& o, const vec3& v) const;
+    virtual vec3 random(const vec3& o) const {
+        if (shapes.empty())
+            return vec3(0, 0, 0);
+        return shapes[table.sample(random_double())]->random(o);
+    }
+    virtual float surface_pdf_value(const vec3& o, const vec3& n, const vec3& v) const;
+    virtual vec3 surface_random(const vec3& o, const vec3& n) const {
+        if (shapes.empty())
+            return vec3(0, 0, 0);
+        double p;
+        return shapes[sample(random_double(), o, n, p)]->random(o);
+    }
+    virtual vec3 sample_direction(const vec3& o, const vec3& n, float& pdf) const;
+
+public:
+    std::vector<shared_ptr<hittable>> shapes;
+    std::vector<double> power;
+    std::vector<vec3> facing;
+
+private:
+    // Picks a light for surface_random; p is its pmf.
+    size_t sample(double u, const vec3& o, const vec3& n, double& p) const;
+    // Probability of taking the left child of interior node i.
+    double left_probability(uint32_t i, const vec3& o, const vec3& n) const {
+        const linear_bvh_node& node = tree.binary.nodes[i];
+        double left = node_bounds[i + 1].importance(o, n);
+        double right = node_bounds[node.offset].importance(o, n);
+        return left + right > 0 ? left / (left + right) : 0.5;
+    }
+    // Importance of each light in leaf node i and their sum; lights that
+    // all look unimportant are weighted equally.
+    double leaf_weights(uint32_t i, const vec3& o, const vec3& n, double* weight) const;
+
+    alias_table table;
+    bvh_tree tree;
+    std::vector<light_bounds> node_bounds;  // per tree.binary node
+    std::vector<light_bounds> bounds;       // per light
+    std::vector<uint32_t> leaf_of;          // leaf node of each light
+    std::vector<uint64_t> trail;            // bit d set: right turn at depth d
+};
+
+// Builds the BVH, reorders the lights into its leaf order, and builds the
+// alias table and the light bounds of every light and node.
+void light_list::build() {
+    std::vector<bvh_primitive> prims(shapes.size());
+    for (size_t i = 0; i < shapes.size(); i++) {
+        shapes[i]->bounding_box(0, 1, prims[i].box);
+        prims[i].centroid = prims[i].box.centroid();
+        prims[i].index = i;
+    }
+    tree.binary.build(prims);
+    tree.finish();
+
+    std::vector<shared_ptr<hittable>> ordered_shapes(shapes.size());
+    std::vector<double> ordered_power(shapes.size());
+    std::vector<vec3> ordered_facing(shapes.size());
+    for (size_t i = 0; i < prims.size(); i++) {
+        ordered_shapes[i] = shapes[prims[i].index];
+        ordered_power[i] = power[prims[i].index];
+        ordered_facing[i] = facing[prims[i].index];
+    }
+    shapes.swap(ordered_shapes);
+    power.swap(ordered_power);
+    facing.swap(ordered_facing);
+    table.build(power);
+
+    bounds.resize(shapes.size());
+    for (size_t i = 0; i < shapes.size(); i++) {
+        light_bounds& b = bounds[i];
+        shapes[i]->bounding_box(0, 1, b.box);
+        b.phi = power[i];
+        if (facing[i].length_squared() > 0) {
+            b.axis = unit_vector(facing[i]);
+            b.cos_theta_o = 1;
+        }
+        else {
+            b.axis = vec3(0, 0, 1);
+            b.cos_theta_o = -1;
+        }
+        b.cos_theta_e = 0;
+    }
+
+    // Children follow their parent in the node array, so a reverse sweep
+    // sees both children of a node before the node itself.
+    const std::vector<linear_bvh_node>& nodes = tree.binary.nodes;
+    node_bounds.assign(nodes.size(), light_bounds());
+    for (size_t i = nodes.size(); i-- > 0;) {
+        const linear_bvh_node& node = nodes[i];
+        if (node.count > 0) {
+            for (uint32_t k = node.offset; k < node.offset + node.count; k++)
+                node_bounds[i] = surrounding_bounds(node_bounds[i], bounds[k]);
+        }
+        else {
+            node_bounds[i] = surrounding_bounds(node_bounds[i + 1], node_bounds[node.offset]);
+        }
+    }
+
+    leaf_of.resize(shapes.size());
+    trail.resize(shapes.size());
+    struct entry {
+        uint32_t node;
+        uint64_t bits;
+        int depth;
+    };
+    std::vector<entry> stack;
+    if (!nodes.empty())
+        stack.push_back(entry{ 0, 0, 0 });
+    while (!stack.empty()) {
+        entry e = stack.back();
+        stack.pop_back();
+        const linear_bvh_node& node = nodes[e.node];
+        if (node.count > 0) {
+            for (uint32_t k = node.offset; k < node.offset + node.count; k++) {
+                leaf_of[k] = e.node;
+                trail[k] = e.bits;
+            }
+            continue;
+        }
+        stack.push_back(entry{ e.node + 1, e.bits, e.depth + 1 });
+        stack.push_back(entry{ node.offset, e.bits | (uint64_t(1) << e.depth), e.depth + 1 });
+    }
+}
+
+double light_list::leaf_weights(uint32_t i, const vec3& o, const vec3& n, double* weight) const {
+    const linear_bvh_node& node = tree.binary.nodes[i];
+    double sum = 0;
+    for (uint32_t k = 0; k < node.count; k++)
+        sum += weight[k] = bounds[node.offset + k].importance(o, n);
+    if (sum > 0)
+        return sum;
+    for (uint32_t k = 0; k < node.count; k++)
+        weight[k] = 1;
+    return node.count;
+}
+
+size_t light_list::sample(double u, const vec3& o, const vec3& n, double& p) const {
+    if (node_bounds[0].importance(o, n) <= 0) {
+        size_t light = table.sample(u);
+        p = table.pmf(light);
+        return light;
+    }
+    const std::vector<linear_bvh_node>& nodes = tree.binary.nodes;
+    p = 1;
+    uint32_t i = 0;
+    while (nodes[i].count == 0) {
+        // Reuse what is left of u below the chosen branch.
+        double left = left_probability(i, o, n);
+        if (u < left) {
+            u = ffmin(u / left, 1 - 1e-12);
+            p *= left;
+            i = i + 1;
+        }
+        else {
+            u = ffmin((u - left) / (1 - left), 1 - 1e-12);
+            p *= 1 - left;
+            i = nodes[i].offset;
+        }
+    }
+    double weight[bvh_max_leaf_size];
+    double sum = leaf_weights(i, o, n, weight);
+    double target = u * sum;
+    uint32_t k = 0;
+    while (k + 1 < nodes[i].count && target >= weight[k])
+        target -= weight[k++];
+    p *= weight[k] / sum;
+    return nodes[i].offset + k;
+}
+
+double light_list::pmf(size_t light, const vec3& o, const vec3& n) const {
+    if (node_bounds[0].importance(o, n) <= 0)
+        return table.pmf(light);
+    const std::vector<linear_bvh_node>& nodes = tree.binary.nodes;
+    double p = 1;
+    uint32_t i = 0;
+    for (int depth = 0; nodes[i].count == 0; depth++) {
+        double left = left_probability(i, o, n);
+        if (trail[light] >> depth & 1) {
+            p *= 1 - left;
+            i = nodes[i].offset;
+        }
+        else {
+            p *= left;
+            i = i + 1;
+        }
+    }
+    double weight[bvh_max_leaf_size];
+    double sum = leaf_weights(i, o, n, weight);
+    return p * weight[light - nodes[i].offset] / sum;
+}
+
+// The chosen light's share of the pdf comes with the sample; only other
+// lights the direction passes through still need their pdf evaluated.
+vec3 light_list::sample_direction(const vec3& o, const vec3& n, float& pdf) const {
+    if (shapes.empty()) {
+        pdf = 0;
+        return vec3(0, 0, 0);
+    }
+    double p;
+    size_t light = sample(random_double(), o, n, p);
+    float shape_pdf;
+    vec3 v = shapes[light]->sample_direction(o, n, shape_pdf);
+    pdf = p * shape_pdf;
+    if (!(pdf > 0))
+        return v;
+    if (shapes.size() > 1) {
+        double t_max = infinity;
+        tree.traverse(ray(o, v), 0.0001, t_max, [&](uint32_t first, uint32_t count) {
+            for (uint32_t i = first; i < first + count; i++)
+                if (i != light)
+                    pdf += pmf(i, o, n) * shapes[i]->pdf_value(o, v);
+            return false;
+        });
+    }
+    return v;
+}
+
+float light_list::surface_pdf_value(const vec3& o, const vec3& n, const vec3& v) const {
+    float sum = 0;
+    double t_max = infinity;
+    tree.traverse(ray(o, v), 0.0001, t_max, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++)
+            sum += pmf(i, o, n) * shapes[i]->pdf_value(o, v);
+        return false;
+    });
+    return sum;
+}
+
+bool light_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    bool found = false;
+    tree.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++) {
+            if (shapes[i]->hit(r, t_min, t_max, rec)) {
+                t_max = rec.t;
+                found = true;
+            }
+        }
+        return false;
+    });
+    return found;
+}
+
+float light_list::pdf_value(const vec3& o, const vec3& v) const {
+    float sum = 0;
+    double t_max = infinity;
+    tree.traverse(ray(o, v), 0.0001, t_max, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++)
+            sum += table.pmf(i) * shapes[i]->pdf_value(o, v);
+        return false;
+    });
+    return sum;
+}
@@ -0,0 +1,716 @@
+#pragma once
+#include "bvh.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Read-only view of a mesh's buffers, which may live in a mesh_data or in
+// a mapped file. Optional arrays are null when absent.
+struct mesh_view {
+    const float* positions = nullptr;       // x, y, z per vertex
+    const float* normals = nullptr;         // x, y, z per vertex
+    const float* uvs = nullptr;             // u, v per vertex
+    const uint32_t* indices = nullptr;      // three per triangle
+    const uint32_t* material_ids = nullptr; // one per triangle
+    size_t vertex_count = 0;
+    size_t triangle_count = 0;
+};
+
+// Vertex and index buffers of a triangle mesh. Attributes are packed
+// floats, one entry per vertex; normals, uvs and material ids may be left
+// empty.
+struct mesh_data {
+    std::vector<float> positions;   // x, y, z per vertex
+    std::vector<float> normals;     // x, y, z per vertex
+    std::vector<float> uvs;         // u, v per vertex
+    std::vector<uint32_t> indices;  // three per triangle
+    std::vector<uint32_t> material_ids;     // one per triangle
+    std::vector<std::string> material_names;
+
+    size_t vertex_count() const { return positions.size() / 3; }
+    size_t triangle_count() const { return indices.size() / 3; }
+
+    mesh_view view() const {
+        mesh_view v;
+        v.positions = positions.data();
+        v.normals = normals.empty() ? nullptr : normals.data();
+        v.uvs = uvs.empty() ? nullptr : uvs.data();
+        v.indices = indices.data();
+        v.material_ids = material_ids.empty() ? nullptr : material_ids.data();
+        v.vertex_count = vertex_count();
+        v.triangle_count = triangle_count();
+        return v;
+    }
+};
+
+// Ray setup for the watertight triangle test of Woop, Benthin and Wald
+// (JCGT 2013): the axes are permuted so the ray runs along z, and the
+// shear that maps it onto the +z axis is precomputed once per ray.
+struct watertight_ray {
+    explicit watertight_ray(const ray& r) : org(r.origin()) {
+        const vec3& d = r.direction();
+        kz = 0;
+        if (std::fabs(d[1]) > std::fabs(d[kz])) kz = 1;
+        if (std::fabs(d[2]) > std::fabs(d[kz])) kz = 2;
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (d[kz] < 0)
+            std::swap(kx, ky);
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1 / d[kz];
+    }
+
+    vec3 org;
+    int kx, ky, kz;
+    real sx, sy, sz;
+};
+
+// Watertight ray/triangle test. The edge functions are evaluated in the
+// sheared ray space, so an edge shared by two triangles is never missed by
+// both. Accepts either winding. On a hit returns t in [t_min, t_max] and
+// the barycentric weights of p1 and p2.
+inline bool intersect_triangle(const watertight_ray& wr, const vec3& p0, const vec3& p1,
+    const vec3& p2, double t_min, double t_max, real& t, real& b1, real& b2) {
+    const vec3 a = p0 - wr.org;
+    const vec3 b = p1 - wr.org;
+    const vec3 c = p2 - wr.org;
+    const real ax = a[wr.kx] - wr.sx * a[wr.kz], ay = a[wr.ky] - wr.sy * a[wr.kz];
+    const real bx = b[wr.kx] - wr.sx * b[wr.kz], by = b[wr.ky] - wr.sy * b[wr.kz];
+    const real cx = c[wr.kx] - wr.sx * c[wr.kz], cy = c[wr.ky] - wr.sy * c[wr.kz];
+
+    real u = cx * by - cy * bx;
+    real v = ax * cy - ay * cx;
+    real w = bx * ay - by * ax;
+    // In single precision an edge function that rounds to zero is redone
+    // in double, which the paper's watertightness argument relies on.
+    if (sizeof(real) < sizeof(double) && (u == 0 || v == 0 || w == 0)) {
+        u = real(double(cx) * by - double(cy) * bx);
+        v = real(double(ax) * cy - double(ay) * cx);
+        w = real(double(bx) * ay - double(by) * ax);
+    }
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        return false;
+    const real det = u + v + w;
+    if (det == 0)
+        return false;
+
+    const real az = wr.sz * a[wr.kz];
+    const real bz = wr.sz * b[wr.kz];
+    const real cz = wr.sz * c[wr.kz];
+    const real hit_t = (u * az + v * bz + w * cz) / det;
+    if (!(hit_t >= t_min && hit_t <= t_max))
+        return false;
+    t = hit_t;
+    b1 = v / det;
+    b2 = w / det;
+    return true;
+}
+
+// Indexed triangle mesh: a single hittable over shared vertex and index
+// buffers, with its own BVH built straight from the triangles. The mesh
+// reads its buffers through a mesh_view, so they can be its own (a loaded
+// mesh_data, reordered into leaf order by the build) or borrowed from a
+// mapped file together with a prebuilt tree.
+class triangle_mesh final : public hittable {
+public:
+    triangle_mesh(mesh_data mesh, material* m, thread_pool* pool = nullptr)
+        : mat_ptr(m), data(std::move(mesh)) {
+        build(pool);
+    }
+
+    // Borrows buffers kept alive by owner. nodes, if given, must be a BVH
+    // over the triangles in the view's order; otherwise the indices and
+    // material ids are copied and a tree is built.
+    triangle_mesh(const mesh_view& v, const linear_bvh_node* nodes, size_t node_count,
+        material* m, std::shared_ptr<const void> owner, thread_pool* pool = nullptr)
+        : view(v), mat_ptr(m), owner(std::move(owner)) {
+        if (nodes) {
+            tree.binary.attach(nodes, node_count);
+            tree.finish();
+            return;
+        }
+        data.indices.assign(v.indices, v.indices + v.triangle_count * 3);
+        if (v.material_ids)
+            data.material_ids.assign(v.material_ids, v.material_ids + v.triangle_count);
+        build(pool);
+    }
+
+    triangle_mesh(const triangle_mesh&) = delete;
+    triangle_mesh& operator=(const triangle_mesh&) = delete;
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const;
+    virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
+        output_box = tree.bounds();
+        return true;
+    }
+
+    size_t triangle_count() const { return view.triangle_count; }
+
+public:
+    mesh_view view;
+    material* mat_ptr;
+    std::vector<material*> materials;   // by material id; mat_ptr if missing
+    bvh_tree tree;
+
+private:
+    vec3 position(uint32_t v) const {
+        const float* p = view.positions + size_t(v) * 3;
+        return vec3(p[0], p[1], p[2]);
+    }
+    bool intersect(uint32_t tri, const watertight_ray& wr, double t_min, double t_max,
+        real& t, real& b1, real& b2) const {
+        const uint32_t* idx = view.indices + size_t(tri) * 3;
+        return intersect_triangle(wr, position(idx[0]), position(idx[1]), position(idx[2]),
+            t_min, t_max, t, b1, b2);
+    }
+    material* material_of(uint32_t tri) const {
+        if (view.material_ids && view.material_ids[tri] < materials.size())
+            return materials[view.material_ids[tri]];
+        return mat_ptr;
+    }
+    void build(thread_pool* pool);
+    void surface(const ray& r, uint32_t tri, real t, real b1, real b2, hit_record& rec) const;
+
+    mesh_data data;                     // owned buffers, if any
+    std::shared_ptr<const void> owner;  // keeps borrowed buffers alive
+};
+
+// Builds the BVH over the triangles in data.indices and reorders them, and
+// their material ids, into leaf order. Vertex buffers may be borrowed.
+void triangle_mesh::build(thread_pool* pool) {
+    if (!owner)
+        view = data.view();
+    const size_t n = data.triangle_count();
+    std::vector<bvh_primitive> prims(n);
+    for (size_t i = 0; i < n; i++) {
+        const uint32_t* idx = &data.indices[i * 3];
+        vec3 lo = position(idx[0]), hi = lo;
+        for (int k = 1; k < 3; k++) {
+            vec3 p = position(idx[k]);
+            for (int a = 0; a < 3; a++) {
+                lo[a] = ffmin(lo[a], p[a]);
+                hi[a] = ffmax(hi[a], p[a]);
+            }
+        }
+        // Pad flat boxes, as the rects do, so the slab test can enter them.
+        for (int a = 0; a < 3; a++) {
+            if (hi[a] - lo[a] < 0.0001) {
+                lo[a] -= 0.0001;
+                hi[a] += 0.0001;
+            }
+        }
+        prims[i].box = aabb(lo, hi);
+        prims[i].centroid = prims[i].box.centroid();
+        prims[i].index = i;
+    }
+    tree.binary.build(prims, pool);
+    tree.finish();
+
+    std::vector<uint32_t> ordered(data.indices.size());
+    for (size_t i = 0; i < n; i++)
+        std::memcpy(&ordered[i * 3], &data.indices[prims[i].index * 3], 3 * sizeof(uint32_t));
+    data.indices.swap(ordered);
+    if (!data.material_ids.empty()) {
+        ordered.resize(n);
+        for (size_t i = 0; i < n; i++)
+            ordered[i] = data.material_ids[prims[i].index];
+        data.material_ids.swap(ordered);
+    }
+    view.indices = data.indices.data();
+    view.material_ids = data.material_ids.empty() ? nullptr : data.material_ids.data();
+    view.triangle_count = n;
+}
+
+// Traversal keeps only the closest t, triangle and barycentrics; the hit
+// record is built once at the end.
+bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    watertight_ray wr(r);
+    bool found = false;
+    uint32_t best = 0;
+    real best_t = 0, best_b1 = 0, best_b2 = 0;
+    tree.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++) {
+            real t, b1, b2;
+            if (intersect(i, wr, t_min, t_max, t, b1, b2)) {
+                t_max = t;
+                best = i;
+                best_t = t;
+                best_b1 = b1;
+                best_b2 = b2;
+                found = true;
+            }
+        }
+        return false;
+    });
+    if (found)
+        surface(r, best, best_t, best_b1, best_b2, rec);
+    return found;
+}
+
+bool triangle_mesh::occluded(const ray& r, double t_min, double t_max) const {
+    watertight_ray wr(r);
+    bool blocked = false;
+    tree.traverse(r, t_min, t_max, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++) {
+            real t, b1, b2;
+            if (intersect(i, wr, t_min, t_max, t, b1, b2) && t > t_min && t < t_max) {
+                blocked = true;
+                return true;
+            }
+        }
+        return false;
+    });
+    return blocked;
+}
+
+// Face orientation comes from the geometric normal; a vertex normal, when
+// present, is interpolated and turned to the same side. Without uvs the
+// barycentrics stand in for them.
+void triangle_mesh::surface(const ray& r, uint32_t tri, real t, real b1, real b2,
+    hit_record& rec) const {
+    const uint32_t* idx = view.indices + size_t(tri) * 3;
+    const vec3 p0 = position(idx[0]);
+    const real b0 = 1 - b1 - b2;
+
+    rec.t = t;
+    rec.hittedPoint = r.at(t);
+    rec.set_face_normal(r, unit_vector(cross(position(idx[1]) - p0, position(idx[2]) - p0)));
+    if (view.normals) {
+        vec3 n(0, 0, 0);
+        const real w[3] = { b0, b1, b2 };
+        for (int k = 0; k < 3; k++) {
+            const float* nk = view.normals + size_t(idx[k]) * 3;
+            n += w[k] * vec3(nk[0], nk[1], nk[2]);
+        }
+        // Normals that cancel out keep the geometric normal.
+        const real length = n.length();
+        if (length > 0) {
+            n /= length;
+            rec.normal = dot(n, rec.normal) < 0 ? -n : n;
+        }
+    }
+    if (view.uvs) {
+        const float* t0 = view.uvs + size_t(idx[0]) * 2;
+        const float* t1 = view.uvs + size_t(idx[1]) * 2;
+        const float* t2 = view.uvs + size_t(idx[2]) * 2;
+        rec.u = b0 * t0[0] + b1 * t1[0] + b2 * t2[0];
+        rec.v = b0 * t0[1] + b1 * t1[1] + b2 * t2[1];
+    }
+    else {
+        rec.u = b1;
+        rec.v = b2;
+    }
+    rec.mat_ptr = material_of(tri);
+}
+
+inline bool read_file(const std::string& path, std::vector<char>& buffer) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        std::cerr << "Could not open " << path << ".\n";
+        return false;
+    }
+    buffer.resize(size_t(in.tellg()));
+    in.seekg(0);
+    in.read(buffer.data(), buffer.size());
+    buffer.push_back('\0');     // lets the parsers run strtod off the end
+    return bool(in);
+}
+
+// Wavefront OBJ: v, vt, vn, f and usemtl records; other records are
+// skipped. usemtl names become material ids; faces before the first one
+// get UINT32_MAX, which triangle_mesh maps to its default material.
+// Polygons are fanned into triangles, and each distinct v/vt/vn corner
+// becomes one vertex. Normals (uvs) are kept only when every corner has
+// one.
+inline bool load_obj(const std::string& path, mesh_data& mesh) {
+    std::vector<char> buffer;
+    if (!read_file(path, buffer))
+        return false;
+
+    std::vector<float> pos, tex, nrm;
+    std::vector<int> corners;       // v, vt, vn per corner, 0-based, -1 if absent
+    std::vector<uint32_t> polygon;  // corner count per face
+    std::vector<uint32_t> polygon_material;
+    std::vector<std::string> material_names;
+    uint32_t current_material = UINT32_MAX;
+    bool all_tex = true, all_nrm = true;
+
+    const char* p = buffer.data();
+    const char* end = p + buffer.size() - 1;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        char* next;
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            for (int k = 0; k < 3; k++, p = next)
+                pos.push_back(std::strtof(p, &next));
+        }
+        else if (p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t')) {
+            p += 2;
+            for (int k = 0; k < 2; k++, p = next)
+                tex.push_back(std::strtof(p, &next));
+        }
+        else if (p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+            p += 2;
+            for (int k = 0; k < 3; k++, p = next)
+                nrm.push_back(std::strtof(p, &next));
+        }
+        else if (std::strncmp(p, "usemtl", 6) == 0 && (p[6] == ' ' || p[6] == '\t')) {
+            p += 6;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            const char* name_end = p;
+            while (*name_end != '\n' && *name_end != '\r' && *name_end != '\0')
+                name_end++;
+            std::string name(p, name_end);
+            current_material = uint32_t(std::find(material_names.begin(), material_names.end(), name)
+                - material_names.begin());
+            if (current_material == material_names.size())
+                material_names.push_back(name);
+        }
+        else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            p++;
+            uint32_t count = 0;
+            while (true) {
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                if (*p == '\n' || *p == '\r' || *p == '\0' || *p == '#')
+                    break;
+                const size_t sizes[3] = { pos.size() / 3, tex.size() / 2, nrm.size() / 3 };
+                int ref[3] = { -1, -1, -1 };
+                for (int k = 0; k < 3; k++) {
+                    if (k > 0) {
+                        if (*p != '/')
+                            break;
+                        p++;
+                    }
+                    if (*p == '/' || *p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == '\0')
+                        continue;
+                    long i = std::strtol(p, &next, 10);
+                    if (next == p) {
+                        std::cerr << path << ": bad face record.\n";
+                        return false;
+                    }
+                    p = next;
+                    i = i < 0 ? long(sizes[k]) + i : i - 1;
+                    if (i < 0 || size_t(i) >= sizes[k]) {
+                        std::cerr << path << ": face index out of range.\n";
+                        return false;
+                    }
+                    ref[k] = int(i);
+                }
+                while (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' && *p != '\0')
+                    p++;
+                all_tex = all_tex && ref[1] >= 0;
+                all_nrm = all_nrm && ref[2] >= 0;
+                corners.insert(corners.end(), ref, ref + 3);
+                count++;
+            }
+            polygon.push_back(count);
+            polygon_material.push_back(current_material);
+        }
+        while (p < end && *p != '\n')
+            p++;
+        p++;
+    }
+
+    // Weld identical corners. The first combination seen for a position is
+    // found through a flat table; only further ones go to the hash map.
+    struct corner_hash {
+        size_t operator()(const std::pair<uint64_t, int>& k) const {
+            return size_t(mix_bits(k.first ^ (uint64_t(uint32_t(k.second)) << 32)));
+        }
+    };
+    std::vector<uint32_t> first_corner(pos.size() / 3, UINT32_MAX);
+    std::unordered_map<std::pair<uint64_t, int>, uint32_t, corner_hash> extra;
+    std::vector<uint32_t> vertex_of(corners.size() / 3);
+    mesh = mesh_data();
+    auto add_vertex = [&](int v, int vt, int vn) {
+        mesh.positions.insert(mesh.positions.end(), &pos[size_t(v) * 3], &pos[size_t(v) * 3] + 3);
+        if (vt >= 0)
+            mesh.uvs.insert(mesh.uvs.end(), &tex[size_t(vt) * 2], &tex[size_t(vt) * 2] + 2);
+        if (vn >= 0)
+            mesh.normals.insert(mesh.normals.end(), &nrm[size_t(vn) * 3], &nrm[size_t(vn) * 3] + 3);
+        return uint32_t(mesh.vertex_count() - 1);
+    };
+    for (size_t c = 0; c < vertex_of.size(); c++) {
+        const int* ref = &corners[c * 3];
+        const int vt = all_tex ? ref[1] : -1;
+        const int vn = all_nrm ? ref[2] : -1;
+        uint32_t& first = first_corner[ref[0]];
+        if (first == UINT32_MAX) {
+            first = uint32_t(c);
+            vertex_of[c] = add_vertex(ref[0], vt, vn);
+            continue;
+        }
+        const int* seen = &corners[size_t(first) * 3];
+        if ((all_tex ? seen[1] : -1) == vt && (all_nrm ? seen[2] : -1) == vn) {
+            vertex_of[c] = vertex_of[first];
+            continue;
+        }
+        auto key = std::make_pair((uint64_t(uint32_t(ref[0])) << 32) | uint32_t(vt), vn);
+        auto it = extra.find(key);
+        if (it == extra.end())
+            it = extra.emplace(key, add_vertex(ref[0], vt, vn)).first;
+        vertex_of[c] = it->second;
+    }
+
+    size_t c = 0;
+    for (size_t f = 0; f < polygon.size(); f++) {
+        for (uint32_t k = 2; k < polygon[f]; k++) {
+            mesh.indices.push_back(vertex_of[c]);
+            mesh.indices.push_back(vertex_of[c + k - 1]);
+            mesh.indices.push_back(vertex_of[c + k]);
+            if (!material_names.empty())
+                mesh.material_ids.push_back(polygon_material[f]);
+        }
+        c += polygon[f];
+    }
+    mesh.material_names = material_names;
+    return true;
+}
+
+// Binary PLY, either byte order. Reads x/y/z, optional nx/ny/nz and u/v
+// (or s/t, texture_u/texture_v) from the vertex element, and the index
+// list of the face element; polygons are fanned into triangles. Other
+// elements and properties are skipped.
+inline bool load_ply(const std::string& path, mesh_data& mesh) {
+    std::vector<char> buffer;
+    if (!read_file(path, buffer))
+        return false;
+
+    struct property {
+        std::string name;
+        int type = 0;           // byte size; negative for signed, 5 for float, 9 for double
+        int count_type = 0;     // list length type, 0 if not a list
+    };
+    struct element {
+        std::string name;
+        size_t count = 0;
+        std::vector<property> props;
+    };
+    auto type_of = [](const std::string& t) {
+        if (t == "char" || t == "int8") return -1;
+        if (t == "uchar" || t == "uint8") return 1;
+        if (t == "short" || t == "int16") return -2;
+        if (t == "ushort" || t == "uint16") return 2;
+        if (t == "int" || t == "int32") return -4;
+        if (t == "uint" || t == "uint32") return 4;
+        if (t == "float" || t == "float32") return 5;
+        if (t == "double" || t == "float64") return 9;
+        return 0;
+    };
+    auto size_of = [](int type) { return type == 5 ? 4 : type == 9 ? 8 : std::abs(type); };
+
+    // Header.
+    std::vector<element> elements;
+    bool big_endian = false;
+    const char* p = buffer.data();
+    const char* end = p + buffer.size() - 1;
+    if (std::strncmp(p, "ply", 3) != 0) {
+        std::cerr << path << ": not a PLY file.\n";
+        return false;
+    }
+    while (true) {
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!eol) {
+            std::cerr << path << ": truncated PLY header.\n";
+            return false;
+        }
+        std::vector<std::string> words;
+        for (const char* q = p; q < eol; ) {
+            while (q < eol && (*q == ' ' || *q == '\r' || *q == '\t'))
+                q++;
+            const char* w = q;
+            while (q < eol && *q != ' ' && *q != '\r' && *q != '\t')
+                q++;
+            if (q > w)
+                words.push_back(std::string(w, q));
+        }
+        p = eol + 1;
+        if (words.empty())
+            continue;
+        if (words[0] == "end_header")
+            break;
+        if (words[0] == "format" && words.size() > 1) {
+            if (words[1] == "binary_big_endian")
+                big_endian = true;
+            else if (words[1] != "binary_little_endian") {
+                std::cerr << path << ": only binary PLY is supported.\n";
+                return false;
+            }
+        }
+        else if (words[0] == "element" && words.size() > 2) {
+            elements.push_back(element());
+            elements.back().name = words[1];
+            elements.back().count = size_t(std::strtoull(words[2].c_str(), nullptr, 10));
+        }
+        else if (words[0] == "property" && !elements.empty()) {
+            property prop;
+            if (words.size() > 4 && words[1] == "list") {
+                prop.count_type = type_of(words[2]);
+                prop.type = type_of(words[3]);
+                prop.name = words[4];
+            }
+            else if (words.size() > 2) {
+                prop.type = type_of(words[1]);
+                prop.name = words[2];
+            }
+            if (prop.type == 0 || (words.size() > 1 && words[1] == "list" && prop.count_type == 0)) {
+                std::cerr << path << ": unknown PLY property type.\n";
+                return false;
+            }
+            elements.back().props.push_back(prop);
+        }
+    }
+
+    // Every record holds at least its scalars and list lengths, so counts
+    // the rest of the file cannot hold are rejected before anything is
+    // allocated for them.
+    size_t remaining = size_t(end - p);
+    for (const element& e : elements) {
+        size_t record = 0;
+        for (const property& prop : e.props)
+            record += size_of(prop.count_type != 0 ? prop.count_type : prop.type);
+        if (record == 0 && e.count != 0) {
+            std::cerr << path << ": PLY element without properties.\n";
+            return false;
+        }
+        if (record != 0 && e.count > remaining / record) {
+            std::cerr << path << ": truncated PLY data.\n";
+            return false;
+        }
+        remaining -= e.count * record;
+    }
+
+    const uint16_t probe = 1;
+    const bool host_big_endian = *reinterpret_cast<const unsigned char*>(&probe) == 0;
+    const bool swap = big_endian != host_big_endian;
+    auto read = [&](const char*& q, int type) -> double {
+        unsigned char b[8] = {};
+        int n = size_of(type);
+        for (int k = 0; k < n; k++)
+            b[k] = q[swap ? n - 1 - k : k];
+        q += n;
+        switch (type) {
+        case -1: { int8_t x; std::memcpy(&x, b, 1); return x; }
+        case 1: { uint8_t x; std::memcpy(&x, b, 1); return x; }
+        case -2: { int16_t x; std::memcpy(&x, b, 2); return x; }
+        case 2: { uint16_t x; std::memcpy(&x, b, 2); return x; }
+        case -4: { int32_t x; std::memcpy(&x, b, 4); return x; }
+        case 4: { uint32_t x; std::memcpy(&x, b, 4); return x; }
+        case 5: { float x; std::memcpy(&x, b, 4); return x; }
+        default: { double x; std::memcpy(&x, b, 8); return x; }
+        }
+    };
+
+    mesh = mesh_data();
+    for (const element& e : elements) {
+        const bool is_vertex = e.name == "vertex";
+        const bool is_face = e.name == "face";
+        // Vertex property -> 0..7 for x y z nx ny nz u v, or -1.
+        std::vector<int> slot(e.props.size(), -1);
+        bool has_normals = false, has_uvs = false;
+        if (is_vertex) {
+            static const char* names[8][3] = {
+                { "x", 0, 0 }, { "y", 0, 0 }, { "z", 0, 0 },
+                { "nx", 0, 0 }, { "ny", 0, 0 }, { "nz", 0, 0 },
+                { "u", "s", "texture_u" }, { "v", "t", "texture_v" } };
+            for (size_t k = 0; k < e.props.size(); k++)
+                for (int s = 0; s < 8; s++)
+                    for (int a = 0; a < 3; a++)
+                        if (names[s][a] && e.props[k].name == names[s][a])
+                            slot[k] = s;
+            for (int s : slot) {
+                has_normals = has_normals || (s >= 3 && s < 6);
+                has_uvs = has_uvs || s >= 6;
+            }
+            mesh.positions.resize(e.count * 3);
+            if (has_normals)
+                mesh.normals.resize(e.count * 3);
+            if (has_uvs)
+                mesh.uvs.resize(e.count * 2);
+        }
+
+        for (size_t i = 0; i < e.count; i++) {
+            for (size_t k = 0; k < e.props.size(); k++) {
+                const property& prop = e.props[k];
+                size_t n = 1;
+                if (prop.count_type != 0 && p + size_of(prop.count_type) <= end) {
+                    const double count = read(p, prop.count_type);
+                    if (count < 0) {
+                        std::cerr << path << ": negative PLY list length.\n";
+                        return false;
+                    }
+                    n = size_t(count);
+                }
+                if (p + n * size_of(prop.type) > end) {
+                    std::cerr << path << ": truncated PLY data.\n";
+                    return false;
+                }
+                if (is_face && prop.count_type != 0
+                    && (prop.name == "vertex_indices" || prop.name == "vertex_index")) {
+                    bool valid = true;
+                    auto index = [&]() {
+                        const double x = read(p, prop.type);
+                        valid = valid && x >= 0 && x <= 4294967295.0;
+                        return valid ? uint32_t(x) : 0u;
+                    };
+                    uint32_t first = n > 0 ? index() : 0;
+                    uint32_t prev = n > 1 ? index() : first;
+                    for (size_t c = 2; c < n; c++) {
+                        uint32_t cur = index();
+                        mesh.indices.push_back(first);
+                        mesh.indices.push_back(prev);
+                        mesh.indices.push_back(cur);
+                        prev = cur;
+                    }
+                    if (!valid) {
+                        std::cerr << path << ": face index out of range.\n";
+                        return false;
+                    }
+                }
+                else if (is_vertex && prop.count_type == 0 && slot[k] >= 0) {
+                    float x = float(read(p, prop.type));
+                    int s = slot[k];
+                    if (s < 3) mesh.positions[i * 3 + s] = x;
+                    else if (s < 6) mesh.normals[i * 3 + s - 3] = x;
+                    else mesh.uvs[i * 2 + s - 6] = x;
+                }
+                else {
+                    p += n * size_of(prop.type);
+                }
+            }
+        }
+    }
+
+    for (uint32_t v : mesh.indices) {
+        if (v >= mesh.vertex_count()) {
+            std::cerr << path << ": face index out of range.\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Loads .obj or .ply by extension.
+inline bool load_mesh(const std::string& path, mesh_data& mesh) {
+    std::string ext = path.size() >= 4 ? path.substr(path.size() - 4) : "";
+    if (ext == ".obj")
+        return load_obj(path, mesh);
+    if (ext == ".ply")
+        return load_ply(path, mesh);
+    std::cerr << "Unknown mesh format: " << path << "\n";
+    return false;
+}
@@ -0,0 +1,344 @@
+#pragma once
+#include "mesh.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file.
+class mapped_file {
+public:
+    mapped_file() {}
+    ~mapped_file() { close(); }
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    const unsigned char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+#ifdef _WIN32
+bool mapped_file::open(const std::string& path) {
+    close();
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        close();
+        return false;
+    }
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping)
+        bytes = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!bytes) {
+        close();
+        return false;
+    }
+    length = size_t(file_size.QuadPart);
+    return true;
+}
+
+void mapped_file::close() {
+    if (bytes)
+        UnmapViewOfFile(bytes);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    bytes = nullptr;
+    length = 0;
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+}
+#else
+bool mapped_file::open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return false;
+    bytes = static_cast<const unsigned char*>(p);
+    length = size_t(st.st_size);
+    return true;
+}
+
+void mapped_file::close() {
+    if (bytes)
+        munmap(const_cast<unsigned char*>(bytes), length);
+    bytes = nullptr;
+    length = 0;
+}
+#endif
+
+// Binary mesh container (.rtm). A fixed header is followed by sections,
+// each starting on a 64-byte boundary, that hold the mesh_view arrays as
+// they are used in memory, so a mapped file is rendered from directly.
+// Triangles are stored in BVH leaf order and the binary BVH nodes are saved
+// with them; the nodes are only used when the loader's node layout (which
+// depends on real) matches, otherwise the tree is rebuilt at load time.
+// Material names are stored as consecutive NUL-terminated strings.
+const char mesh_file_magic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0' };
+const uint32_t mesh_file_version = 1;
+const uint32_t mesh_file_byte_order = 0x01020304;
+const uint64_t mesh_file_alignment = 64;
+
+struct mesh_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;    // reads back differently on the other endianness
+    uint32_t real_size;     // sizeof(real) of the writer
+    uint32_t node_size;     // sizeof(linear_bvh_node) of the writer
+    uint64_t vertex_count;
+    uint64_t triangle_count;
+    uint64_t node_count;
+    uint64_t material_count;
+    // Byte offsets of the sections from the start of the file; 0 when a
+    // section is absent.
+    uint64_t positions;
+    uint64_t normals;
+    uint64_t uvs;
+    uint64_t indices;
+    uint64_t material_ids;
+    uint64_t nodes;
+    uint64_t material_names;
+    uint64_t file_size;
+};
+
+// A mesh file opened for rendering. view and nodes point into the mapping,
+// which stays open as long as file is referenced.
+struct mesh_file {
+    std::shared_ptr<mapped_file> file;
+    mesh_view view;
+    const linear_bvh_node* nodes = nullptr;     // null if unusable
+    size_t node_count = 0;
+    std::vector<std::string> material_names;
+};
+
+inline bool write_mesh_file(const std::string& path, const triangle_mesh& mesh,
+    const std::vector<std::string>& material_names = std::vector<std::string>()) {
+    const mesh_view& v = mesh.view;
+    const linear_bvh& tree = mesh.tree.binary;
+
+    std::string names;
+    for (const std::string& name : material_names)
+        names.append(name.c_str(), name.size() + 1);
+
+    mesh_file_header h;
+    std::memset(&h, 0, sizeof h);
+    std::memcpy(h.magic, mesh_file_magic, sizeof h.magic);
+    h.version = mesh_file_version;
+    h.byte_order = mesh_file_byte_order;
+    h.real_size = sizeof(real);
+    h.node_size = sizeof(linear_bvh_node);
+    h.vertex_count = v.vertex_count;
+    h.triangle_count = v.triangle_count;
+    h.node_count = tree.node_count();
+    h.material_count = material_names.size();
+
+    struct section {
+        uint64_t* offset;
+        const void* data;
+        size_t size;
+    };
+    const section sections[] = {
+        { &h.positions, v.positions, v.vertex_count * 3 * sizeof(float) },
+        { &h.normals, v.normals, v.normals ? v.vertex_count * 3 * sizeof(float) : 0 },
+        { &h.uvs, v.uvs, v.uvs ? v.vertex_count * 2 * sizeof(float) : 0 },
+        { &h.indices, v.indices, v.triangle_count * 3 * sizeof(uint32_t) },
+        { &h.material_ids, v.material_ids, v.material_ids ? v.triangle_count * sizeof(uint32_t) : 0 },
+        { &h.nodes, tree.node_data(), tree.node_count() * sizeof(linear_bvh_node) },
+        { &h.material_names, names.data(), names.size() },
+    };
+    uint64_t end = sizeof h;
+    for (const section& s : sections) {
+        if (s.size == 0)
+            continue;
+        end = (end + mesh_file_alignment - 1) / mesh_file_alignment * mesh_file_alignment;
+        *s.offset = end;
+        end += s.size;
+    }
+    h.file_size = end;
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        std::cerr << "Could not open " << path << " for writing.\n";
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(&h), sizeof h);
+    uint64_t pos = sizeof h;
+    static const char zeros[mesh_file_alignment] = {};
+    for (const section& s : sections) {
+        if (s.size == 0)
+            continue;
+        out.write(zeros, std::streamsize(*s.offset - pos));
+        out.write(static_cast<const char*>(s.data), std::streamsize(s.size));
+        pos = *s.offset + s.size;
+    }
+    if (!out) {
+        std::cerr << "Failed writing " << path << ".\n";
+        return false;
+    }
+    return true;
+}
+
+// True if nodes form a tree that traversal can walk safely: every child
+// index lies in the array after its parent and is reached once, the depth
+// fits the traversal stack, and leaves cover triangles in range.
+inline bool valid_mesh_nodes(const linear_bvh_node* nodes, size_t node_count, size_t triangle_count) {
+    if (node_count == 0)
+        return triangle_count == 0;
+    std::vector<bool> seen(node_count, false);
+    std::vector<std::pair<size_t, int>> stack(1, std::make_pair(size_t(0), 1));
+    while (!stack.empty()) {
+        const size_t i = stack.back().first;
+        const int depth = stack.back().second;
+        stack.pop_back();
+        if (seen[i] || depth > linear_bvh::max_depth)
+            return false;
+        seen[i] = true;
+        const linear_bvh_node& node = nodes[i];
+        if (node.count > 0) {
+            if (node.offset > triangle_count || node.count > triangle_count - node.offset)
+                return false;
+            continue;
+        }
+        if (node.axis > 2 || i + 1 >= node_count || node.offset <= i + 1 || node.offset >= node_count)
+            return false;
+        stack.push_back(std::make_pair(i + 1, depth + 1));
+        stack.push_back(std::make_pair(size_t(node.offset), depth + 1));
+    }
+    return true;
+}
+
+// Maps path and checks the header, that every section lies inside the
+// file, that all vertex indices are in range and that the stored BVH is a
+// well-formed tree over the triangles. Nothing is copied or parsed apart
+// from the material names.
+inline bool open_mesh_file(const std::string& path, mesh_file& mf) {
+    auto file = std::make_shared<mapped_file>();
+    if (!file->open(path)) {
+        std::cerr << "Could not map " << path << "\n";
+        return false;
+    }
+    mesh_file_header h;
+    if (file->size() < sizeof h) {
+        std::cerr << path << ": not a mesh file.\n";
+        return false;
+    }
+    std::memcpy(&h, file->data(), sizeof h);
+    if (std::memcmp(h.magic, mesh_file_magic, sizeof h.magic) != 0) {
+        std::cerr << path << ": not a mesh file.\n";
+        return false;
+    }
+    if (h.byte_order != mesh_file_byte_order) {
+        std::cerr << path << ": written on a machine of the other byte order.\n";
+        return false;
+    }
+    if (h.version != mesh_file_version) {
+        std::cerr << path << ": unsupported mesh file version " << h.version << ".\n";
+        return false;
+    }
+
+    const uint64_t size = file->size();
+    bool ok = h.file_size <= size && h.positions != 0 && h.indices != 0;
+    // Checks count elements of elem bytes by division, so that no size
+    // computed from the header can overflow.
+    auto section = [&](uint64_t offset, uint64_t count, uint64_t elem) -> const unsigned char* {
+        if (offset == 0)
+            return nullptr;
+        if (offset % mesh_file_alignment != 0 || offset > size || count > (size - offset) / elem) {
+            ok = false;
+            return nullptr;
+        }
+        return file->data() + offset;
+    };
+    mesh_view v;
+    v.vertex_count = size_t(h.vertex_count);
+    v.triangle_count = size_t(h.triangle_count);
+    v.positions = reinterpret_cast<const float*>(section(h.positions, h.vertex_count, 3 * sizeof(float)));
+    v.normals = reinterpret_cast<const float*>(section(h.normals, h.vertex_count, 3 * sizeof(float)));
+    v.uvs = reinterpret_cast<const float*>(section(h.uvs, h.vertex_count, 2 * sizeof(float)));
+    v.indices = reinterpret_cast<const uint32_t*>(section(h.indices, h.triangle_count, 3 * sizeof(uint32_t)));
+    v.material_ids = reinterpret_cast<const uint32_t*>(section(h.material_ids, h.triangle_count, sizeof(uint32_t)));
+    const bool same_layout = h.real_size == sizeof(real) && h.node_size == sizeof(linear_bvh_node);
+    const unsigned char* nodes = same_layout ? section(h.nodes, h.node_count, sizeof(linear_bvh_node)) : nullptr;
+    const unsigned char* names = section(h.material_names, size - h.material_names, 1);
+    if (!ok) {
+        std::cerr << path << ": truncated or corrupt mesh file.\n";
+        return false;
+    }
+    for (size_t k = 0; k < v.triangle_count * 3; k++) {
+        if (v.indices[k] >= v.vertex_count) {
+            std::cerr << path << ": vertex index out of range.\n";
+            return false;
+        }
+    }
+    if (nodes && !valid_mesh_nodes(reinterpret_cast<const linear_bvh_node*>(nodes), size_t(h.node_count),
+            v.triangle_count)) {
+        std::cerr << path << ": corrupt BVH nodes.\n";
+        return false;
+    }
+
+    mf.material_names.clear();
+    if (names) {
+        const char* p = reinterpret_cast<const char*>(names);
+        const char* end = reinterpret_cast<const char*>(file->data() + size);
+        for (uint64_t k = 0; k < h.material_count; k++) {
+            const char* q = static_cast<const char*>(std::memchr(p, '\0', size_t(end - p)));
+            if (!q)
+                break;
+            mf.material_names.emplace_back(p, q);
+            p = q + 1;
+        }
+    }
+    mf.view = v;
+    mf.nodes = reinterpret_cast<const linear_bvh_node*>(nodes);
+    mf.node_count = nodes ? size_t(h.node_count) : 0;
+    mf.file = file;
+    return true;
+}
+
+// Triangle mesh rendered straight from the mapped file at path.
+inline std::shared_ptr<triangle_mesh> load_mesh_file(const std::string& path, material* m,
+    thread_pool* pool = nullptr) {
+    mesh_file mf;
+    if (!open_mesh_file(path, mf))
+        return nullptr;
+    return std::make_shared<triangle_mesh>(mf.view, mf.nodes, mf.node_count, m, mf.file, pool);
+}
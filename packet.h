@@ -0,0 +1,193 @@
+#pragma once
+#include "bvh.h"
+#include "camera.h"
+#include "integrator.h"
+#include "render.h"
+#include <cmath>
+
+const int max_packet_rays = 64;
+
+// Up to 8x8 primary rays traced through the BVH together. Each ray keeps
+// its own closest distance and hit record.
+struct ray_packet {
+    int count = 0;
+    ray rays[max_packet_rays];
+    double t_max[max_packet_rays];
+    bool hit[max_packet_rays];
+    hit_record rec[max_packet_rays];
+};
+
+// Bounds on origin and reciprocal direction over a whole packet, used to
+// reject boxes that no ray in it can enter.
+struct packet_interval {
+    double org_min[3], org_max[3];
+    double inv_min[3], inv_max[3];
+    int sign[3];
+    bool coherent;  // every ray has the same direction signs
+    bool finite;    // no direction component is zero
+
+    explicit packet_interval(const ray_packet& p) {
+        coherent = true;
+        finite = true;
+        for (int a = 0; a < 3; a++) {
+            org_min[a] = org_max[a] = p.rays[0].origin()[a];
+            inv_min[a] = inv_max[a] = p.rays[0].inv_direction()[a];
+            sign[a] = p.rays[0].sign[a];
+            for (int k = 0; k < p.count; k++) {
+                const ray& r = p.rays[k];
+                org_min[a] = ffmin(org_min[a], r.origin()[a]);
+                org_max[a] = ffmax(org_max[a], r.origin()[a]);
+                inv_min[a] = ffmin(inv_min[a], r.inv_direction()[a]);
+                inv_max[a] = ffmax(inv_max[a], r.inv_direction()[a]);
+                coherent = coherent && r.sign[a] == sign[a];
+                finite = finite && std::isfinite(double(r.inv_direction()[a]));
+            }
+        }
+    }
+
+    // True when the box is missed by every ray of the packet over
+    // [t_min, t_max]. Interval arithmetic gives a lower bound on each slab's
+    // entry distance and an upper bound on its exit distance.
+    bool misses(const aabb& box, double t_min, double t_max) const {
+        if (!finite)
+            return false;
+        double enter = t_min, exit = t_max;
+        for (int a = 0; a < 3; a++) {
+            double near_plane = sign[a] ? box.max()[a] : box.min()[a];
+            double far_plane = sign[a] ? box.min()[a] : box.max()[a];
+            enter = ffmax(enter, lower(near_plane - org_max[a], near_plane - org_min[a], a));
+            exit = ffmin(exit, upper(far_plane - org_max[a], far_plane - org_min[a], a));
+        }
+        return enter > exit;
+    }
+
+private:
+    double lower(double d0, double d1, int a) const {
+        return ffmin(ffmin(d0 * inv_min[a], d0 * inv_max[a]), ffmin(d1 * inv_min[a], d1 * inv_max[a]));
+    }
+    double upper(double d0, double d1, int a) const {
+        return ffmax(ffmax(d0 * inv_min[a], d0 * inv_max[a]), ffmax(d1 * inv_min[a], d1 * inv_max[a]));
+    }
+};
+
+// Finds the closest hit of every ray in the packet. The packet walks the
+// binary BVH as one: a node is skipped when the interval test rejects it
+// or no active ray enters it, and leaves are tested only for rays from the
+// first one that enters. Packets whose direction signs disagree are traced
+// as single rays. As in bvh_node::hit, hit records are filled in only for
+// each ray's final hit.
+inline void trace_packet(const bvh_node& bvh, ray_packet& p, double t_min) {
+    for (int k = 0; k < p.count; k++) {
+        p.t_max[k] = infinity;
+        p.hit[k] = false;
+    }
+    packet_interval interval(p);
+    if (!interval.coherent) {
+        for (int k = 0; k < p.count; k++)
+            p.hit[k] = bvh.hit(p.rays[k], t_min, p.t_max[k], p.rec[k]);
+        return;
+    }
+    const std::vector<linear_bvh_node>& nodes = bvh.tree.binary.nodes;
+    if (nodes.empty())
+        return;
+
+    struct entry {
+        uint32_t index;
+        int first;
+    };
+    entry stack[64];
+    int sp = 0;
+    entry e{ 0, 0 };
+    surface_hit closest[max_packet_rays];
+    double packet_t_max = infinity;
+    while (true) {
+        const linear_bvh_node& node = nodes[e.index];
+        int k = e.first;
+        if (!interval.misses(node.box, t_min, packet_t_max)) {
+            while (k < p.count && !node.box.hit(p.rays[k], t_min, p.t_max[k]))
+                k++;
+        }
+        else {
+            k = p.count;
+        }
+
+        if (k < p.count) {
+            if (node.count > 0) {
+                for (int j = k; j < p.count; j++) {
+                    if (j > k && !node.box.hit(p.rays[j], t_min, p.t_max[j]))
+                        continue;
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                        if (bvh.store.intersect(bvh.prims[i], p.rays[j], t_min, p.t_max[j], closest[j], p.rec[j])) {
+                            p.t_max[j] = closest[j].t;
+                            p.hit[j] = true;
+                        }
+                    }
+                }
+                packet_t_max = 0;
+                for (int j = 0; j < p.count; j++)
+                    packet_t_max = ffmax(packet_t_max, p.t_max[j]);
+            }
+            else if (interval.sign[node.axis]) {
+                stack[sp++] = entry{ e.index + 1, k };
+                e = entry{ node.offset, k };
+                continue;
+            }
+            else {
+                stack[sp++] = entry{ node.offset, k };
+                e = entry{ e.index + 1, k };
+                continue;
+            }
+        }
+        if (sp == 0)
+            break;
+        e = stack[--sp];
+    }
+    for (int k = 0; k < p.count; k++)
+        if (p.hit[k])
+            bvh.store.surface(closest[k], p.rays[k], p.rec[k]);
+}
+
+// Tile renderer that traces primary rays in packet_size x packet_size
+// blocks. Each pixel starts its sampler exactly as the single-ray path in
+// main does, and the sampler state after the camera sample is restored
+// before shading, so both modes produce the same image. Bounces after the
+// first hit diverge and are traced one ray at a time.
+inline void render_packets(thread_pool& pool, const render_options& opt, framebuffer& fb,
+    const camera& cam, const bvh_node& world, hittable* lights) {
+    const int block = opt.packet_size > 8 ? 8 : opt.packet_size;
+    for_each_tile(pool, opt, fb, [&](int x0, int y0, int x1, int y1) {
+        ray_packet packet;
+        sampler rng[max_packet_rays];
+        vec3 color[max_packet_rays];
+        for (int by = y0; by < y1; by += block) {
+            for (int bx = x0; bx < x1; bx += block) {
+                int w = std::min(block, x1 - bx);
+                int h = std::min(block, y1 - by);
+                packet.count = w * h;
+                for (int k = 0; k < packet.count; k++)
+                    color[k] = vec3(0, 0, 0);
+
+                for (int s = 0; s < opt.samples_per_pixel; s++) {
+                    for (int k = 0; k < packet.count; k++) {
+                        int i = bx + k % w, j = by + k / w;
+                        start_pixel_sample(i, j, s, opt);
+                        auto x = (i + random_double()) / opt.image_width;
+                        auto y = (j + random_double()) / opt.image_height;
+                        packet.rays[k] = cam.get_ray(x, y);
+                        rng[k] = thread_sampler();
+                    }
+                    trace_packet(world, packet, 0.001);
+                    for (int k = 0; k < packet.count; k++) {
+                        thread_sampler() = rng[k];
+                        color[k] += ray_color(packet.rays[k], packet.hit[k], packet.rec[k],
+                            world, lights, opt);
+                        thread_arena().reset();
+                    }
+                }
+
+                for (int k = 0; k < packet.count; k++)
+                    fb.set(bx + k % w, by + k / w, color[k]);
+            }
+        }
+    });
+}
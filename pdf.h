@@ -7,6 +7,13 @@ class pdf {
 public:
 	virtual float value(const vec3& direction) const = 0;
 	virtual vec3 generate() const = 0;
+	// generate() and the value of the result, for pdfs that can give both
+	// for less than the two calls.
+	virtual vec3 sample(float& pdf_val) const {
+		vec3 direction = generate();
+		pdf_val = value(direction);
+		return direction;
+	}
 };
 class cosine_pdf: public pdf{
 public:
@@ -26,14 +33,19 @@ public:
 };
 class hittable_pdf :public pdf {
 public:
-	hittable_pdf(hittable* p, const vec3& origin) :ptr(p), o(origin) {}
+	hittable_pdf(hittable* p, const vec3& origin, const vec3& normal = vec3(0, 0, 0))
+		:o(origin), n(normal), ptr(p) {}
 	virtual float value(const vec3& direction) const{
-		return ptr->pdf_value(o, direction);
+		return ptr->surface_pdf_value(o, n, direction);
 	}
 	virtual vec3 generate() const {
-		return ptr->random(o);
+		return ptr->surface_random(o, n);
+	}
+	virtual vec3 sample(float& pdf_val) const {
+		return ptr->sample_direction(o, n, pdf_val);
 	}
 	vec3 o;
+	vec3 n;	// surface normal at o, or zero if there is none
 	hittable* ptr;
 
 };
@@ -50,5 +62,14 @@ public:
 		else
 			return p[1]->generate();
 	}
+	// Only the other component's value has to be evaluated. A component
+	// that fails to sample (pdf 0) fails the mixture too.
+	virtual vec3 sample(float& pdf_val) const {
+		float chosen;
+		const int k = random_double() < 0.5 ? 0 : 1;
+		vec3 direction = p[k]->sample(chosen);
+		pdf_val = chosen > 0 ? 0.5 * chosen + 0.5 * p[1 - k]->value(direction) : 0;
+		return direction;
+	}
 	pdf* p[2];
 };
\ No newline at end of file
@@ -36,7 +36,7 @@ public:
         ranvec = new vec3[point_count];
 
         for (int i = 0; i < point_count; ++i) {
-            ranvec[i] = unit_vector(random(-1, 1));
+            ranvec[i] = unit_vector(vec3::random(-1, 1));
         }
 
         perm_x = perlin_generate_perm();
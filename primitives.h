@@ -0,0 +1,177 @@
+#pragma once
+#include "hittable_List.h"
+#include "rectangle.h"
+#include "sphere.h"
+#include "sphere_batch.h"
+#include <cstdint>
+#include <vector>
+
+enum primitive_type : uint32_t {
+    primitive_sphere,
+    primitive_moving_sphere,
+    primitive_xy_rect,
+    primitive_xz_rect,
+    primitive_yz_rect,
+    primitive_translate,
+    primitive_rotate_y,
+    primitive_sphere_batch,
+    primitive_other
+};
+
+// Handle to one primitive in a primitive_set: its type and its slot in the
+// array for that type.
+struct primitive_ref {
+    primitive_type type;
+    uint32_t index;
+};
+
+// Closest-hit candidate kept during traversal: just enough to build the
+// full hit_record afterwards with primitive_set::surface.
+struct surface_hit {
+    real t;
+    primitive_ref prim;
+    int lane;   // winning sphere of a sphere_batch
+};
+
+// Closed-set primitive storage. Objects of each known type are copied into
+// their own contiguous array and reached through a type tag, so leaf code
+// switches on the tag and calls the concrete (final) class directly, which
+// the compiler can inline. Boxes are split into their six rects. Anything
+// else is kept as a shared_ptr and called virtually.
+class primitive_set {
+public:
+    // Adds object, appending one handle per stored primitive to out.
+    void add(const shared_ptr<hittable>& object, std::vector<primitive_ref>& out) {
+        const hittable* h = object.get();
+        if (auto s = dynamic_cast<const sphere*>(h))
+            out.push_back(push(spheres, *s, primitive_sphere));
+        else if (auto s = dynamic_cast<const moving_sphere*>(h))
+            out.push_back(push(moving_spheres, *s, primitive_moving_sphere));
+        else if (auto s = dynamic_cast<const xy_rect*>(h))
+            out.push_back(push(xy_rects, *s, primitive_xy_rect));
+        else if (auto s = dynamic_cast<const xz_rect*>(h))
+            out.push_back(push(xz_rects, *s, primitive_xz_rect));
+        else if (auto s = dynamic_cast<const yz_rect*>(h))
+            out.push_back(push(yz_rects, *s, primitive_yz_rect));
+        else if (auto s = dynamic_cast<const translate*>(h))
+            out.push_back(push(translates, *s, primitive_translate));
+        else if (auto s = dynamic_cast<const rotate_y*>(h))
+            out.push_back(push(rotations, *s, primitive_rotate_y));
+        else if (auto b = dynamic_cast<const box*>(h)) {
+            for (const auto& side : b->sides.objects)
+                add(side, out);
+        }
+        else
+            out.push_back(push(others, object, primitive_other));
+    }
+
+    // Calls fn with the primitive as its concrete type.
+    template <typename Fn>
+    auto dispatch(primitive_ref p, Fn&& fn) const -> decltype(fn(std::declval<const hittable&>())) {
+        switch (p.type) {
+        case primitive_sphere: return fn(spheres[p.index]);
+        case primitive_moving_sphere: return fn(moving_spheres[p.index]);
+        case primitive_xy_rect: return fn(xy_rects[p.index]);
+        case primitive_xz_rect: return fn(xz_rects[p.index]);
+        case primitive_yz_rect: return fn(yz_rects[p.index]);
+        case primitive_translate: return fn(translates[p.index]);
+        case primitive_rotate_y: return fn(rotations[p.index]);
+        case primitive_sphere_batch: return fn(sphere_batches[p.index]);
+        default: return fn(static_cast<const hittable&>(*others[p.index]));
+        }
+    }
+
+    // Replaces the spheres among refs, static or moving, with sphere_batch
+    // primitives of up to sphere_batch_width lanes each. A lone sphere is
+    // left as it is.
+    void batch_spheres(std::vector<primitive_ref>& refs) {
+        std::vector<primitive_ref> spheres_in, rest;
+        for (primitive_ref p : refs) {
+            if (p.type == primitive_sphere || p.type == primitive_moving_sphere)
+                spheres_in.push_back(p);
+            else
+                rest.push_back(p);
+        }
+        if (spheres_in.size() < 2)
+            return;
+        refs.clear();
+        for (size_t i = 0; i < spheres_in.size(); i += sphere_batch_width) {
+            sphere_batch batch;
+            for (size_t k = i; k < spheres_in.size() && k < i + sphere_batch_width; k++) {
+                if (spheres_in[k].type == primitive_sphere)
+                    batch.add(spheres[spheres_in[k].index]);
+                else
+                    batch.add(moving_spheres[spheres_in[k].index]);
+            }
+            refs.push_back(push(sphere_batches, batch, primitive_sphere_batch));
+        }
+        refs.insert(refs.end(), rest.begin(), rest.end());
+    }
+
+    bool hit(primitive_ref p, const ray& r, double t_min, double t_max, hit_record& rec) const {
+        return dispatch(p, [&](const auto& o) { return o.hit(r, t_min, t_max, rec); });
+    }
+    // Deferred closest-hit test. Spheres and rects only compute t here and
+    // leave normals, uvs and material to surface(), which runs once for the
+    // final hit. Instances and unknown types have no split and fill rec
+    // directly; surface() then leaves it alone. h is updated only on a hit.
+    bool intersect(primitive_ref p, const ray& r, double t_min, double t_max,
+        surface_hit& h, hit_record& rec) const {
+        real t;
+        int lane = 0;
+        bool found;
+        switch (p.type) {
+        case primitive_sphere: found = spheres[p.index].intersect(r, t_min, t_max, t); break;
+        case primitive_moving_sphere: found = moving_spheres[p.index].intersect(r, t_min, t_max, t); break;
+        case primitive_xy_rect: found = xy_rects[p.index].intersect(r, t_min, t_max, t); break;
+        case primitive_xz_rect: found = xz_rects[p.index].intersect(r, t_min, t_max, t); break;
+        case primitive_yz_rect: found = yz_rects[p.index].intersect(r, t_min, t_max, t); break;
+        case primitive_sphere_batch: found = sphere_batches[p.index].intersect(r, t_min, t_max, t, lane); break;
+        default:
+            found = hit(p, r, t_min, t_max, rec);
+            t = rec.t;
+            break;
+        }
+        if (found)
+            h = surface_hit{ t, p, lane };
+        return found;
+    }
+
+    void surface(const surface_hit& h, const ray& r, hit_record& rec) const {
+        const primitive_ref& p = h.prim;
+        switch (p.type) {
+        case primitive_sphere: spheres[p.index].surface(r, h.t, rec); break;
+        case primitive_moving_sphere: moving_spheres[p.index].surface(r, h.t, rec); break;
+        case primitive_xy_rect: xy_rects[p.index].surface(r, h.t, rec); break;
+        case primitive_xz_rect: xz_rects[p.index].surface(r, h.t, rec); break;
+        case primitive_yz_rect: yz_rects[p.index].surface(r, h.t, rec); break;
+        case primitive_sphere_batch: sphere_batches[p.index].surface(r, h.t, h.lane, rec); break;
+        default: break;
+        }
+    }
+
+    bool occluded(primitive_ref p, const ray& r, double t_min, double t_max) const {
+        return dispatch(p, [&](const auto& o) { return o.occluded(r, t_min, t_max); });
+    }
+    bool bounding_box(primitive_ref p, double t0, double t1, aabb& output_box) const {
+        return dispatch(p, [&](const auto& o) { return o.bounding_box(t0, t1, output_box); });
+    }
+
+public:
+    std::vector<sphere> spheres;
+    std::vector<moving_sphere> moving_spheres;
+    std::vector<xy_rect> xy_rects;
+    std::vector<xz_rect> xz_rects;
+    std::vector<yz_rect> yz_rects;
+    std::vector<translate> translates;
+    std::vector<rotate_y> rotations;
+    std::vector<sphere_batch> sphere_batches;
+    std::vector<shared_ptr<hittable>> others;
+
+private:
+    template <typename T, typename V>
+    static primitive_ref push(std::vector<T>& array, const V& value, primitive_type type) {
+        array.push_back(value);
+        return primitive_ref{ type, uint32_t(array.size() - 1) };
+    }
+};
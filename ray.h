@@ -6,25 +6,37 @@
 class ray {
 public:
 	ray() {}
-	ray(const vec3& origin, const vec3& direction, double time = 0.0)
-		 : orig(origin), dir(direction), tm(time)
-		 {}
+	ray(const vec3& origin, const vec3& direction, real time = 0.0)
+		 : orig(origin), dir(direction), tm(time),
+		   inv_dir(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z())
+		 {
+		sign[0] = inv_dir.x() < 0;
+		sign[1] = inv_dir.y() < 0;
+		sign[2] = inv_dir.z() < 0;
+	}
 
-	vec3 origin() const {
+	const vec3& origin() const {
 		return orig;
 	}
-	vec3 direction() const {
+	const vec3& direction() const {
 		return dir;
 	}
+	// Per-axis reciprocal direction and sign (1 when negative), computed
+	// once per ray for the slab tests in aabb::hit.
+	const vec3& inv_direction() const {
+		return inv_dir;
+	}
 	vec3 at(double t) const{
 		return orig + t * dir;
 	}
-	double time() const { return tm; }
+	real time() const { return tm; }
 
+	int sign[3];
 
 private:
 	vec3 orig;
 	vec3 dir;
-	double tm;
+	real tm;
+	vec3 inv_dir;
 };
 #endif
\ No newline at end of file
@@ -1,14 +1,27 @@
 #pragma once
 #include "hittable.h"
 #include "pdf.h"
-class xy_rect : public hittable {
+class xy_rect final : public hittable {
 public:
     xy_rect() {}
 
-    xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat)
+    xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, material* mat)
         : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
     virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+    bool intersect(const ray& r, double t0, double t1, real& t) const;
+    virtual void surface(const ray& r, real t, hit_record& rec) const;
+    virtual bool deferred_hit(const ray& r, double t0, double t1, real& t, hit_record& rec) const {
+        return intersect(r, t0, t1, t);
+    }
+    virtual bool occluded(const ray& r, double t0, double t1) const {
+        auto t = (k - r.origin().z()) / r.direction().z();
+        if (!(t > t0 && t < t1))
+            return false;
+        auto x = r.origin().x() + t * r.direction().x();
+        auto y = r.origin().y() + t * r.direction().y();
+        return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+    }
 
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
         output_box = aabb(vec3(x0, y0, k - 0.0001), vec3(x1, y1, k + 0.0001));
@@ -16,17 +29,21 @@ public:
     }
 
 public:
-    shared_ptr<material> mp;
-    double x0, x1, y0, y1, k;
+    material* mp;
+    real x0, x1, y0, y1, k;
 };
-bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
-    auto t = (k - r.origin().z()) / r.direction().z();
+bool xy_rect::intersect(const ray& r, double t0, double t1, real& t) const {
+    t = (k - r.origin().z()) / r.direction().z();
     if (t < t0 || t > t1)
         return false;
     auto x = r.origin().x() + t * r.direction().x();
     auto y = r.origin().y() + t * r.direction().y();
-    if (x < x0 || x > x1 || y < y0 || y > y1)
-        return false;
+    return !(x < x0 || x > x1 || y < y0 || y > y1);
+}
+
+void xy_rect::surface(const ray& r, real t, hit_record& rec) const {
+    auto x = r.origin().x() + t * r.direction().x();
+    auto y = r.origin().y() + t * r.direction().y();
     rec.u = (x - x0) / (x1 - x0);
     rec.v = (y - y0) / (y1 - y0);
     rec.t = t;
@@ -34,49 +51,97 @@ bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
     rec.hittedPoint = r.at(t);
+}
+
+bool xy_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
+    real t;
+    if (!intersect(r, t0, t1, t))
+        return false;
+    surface(r, t, rec);
     return true;
 }
-class xz_rect : public hittable {
+class xz_rect final : public hittable {
 public:
     xz_rect() {}
 
-    xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, shared_ptr<material> mat)
+    xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, material* mat)
         : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
     virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+    bool intersect(const ray& r, double t0, double t1, real& t) const;
+    virtual void surface(const ray& r, real t, hit_record& rec) const;
+    virtual bool deferred_hit(const ray& r, double t0, double t1, real& t, hit_record& rec) const {
+        return intersect(r, t0, t1, t);
+    }
+    virtual bool occluded(const ray& r, double t0, double t1) const {
+        auto t = (k - r.origin().y()) / r.direction().y();
+        if (!(t > t0 && t < t1))
+            return false;
+        auto x = r.origin().x() + t * r.direction().x();
+        auto z = r.origin().z() + t * r.direction().z();
+        return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+    }
 
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
         output_box = aabb(vec3(x0, k - 0.0001, z0), vec3(x1, k + 0.0001, z1));
         return true;
     }
+    // Solid-angle pdf of random(o): the area pdf converted by the squared
+    // distance to the plane crossing and the cosine there. A direction parallel
+    // to the plane makes t infinite or NaN and gets 0.
     virtual float pdf_value(const vec3& o, const vec3& v) const {
-        hit_record rec;
-        if (this->hit(ray(o, v), 0.0001, infinity, rec)) {
+        real t = (k - o.y()) / v.y();
+        if (!(t >= 0.0001 && t < infinity))
+            return 0;
+        auto x = o.x() + t * v.x();
+        auto z = o.z() + t * v.z();
+        if (x < x0 || x > x1 || z < z0 || z > z1)
+            return 0;
         float area = (x1-x0)*(z1-z0);
-        float distance_squared = rec.t * rec.t * v.length_squared();
-        float cosine = fabs(dot(v, rec.normal) / v.length());
+        float distance_squared = t * t * v.length_squared();
+        float cosine = fabs(v.y() / v.length());
         return distance_squared / (cosine * area);
-        }
-        else 
-            return 0;
     }
     virtual vec3 random(const vec3 & o) const {
         vec3 random_point = vec3(x0 + random_double() * (x1 - x0), k, z0 + random_double() * (z1 - z0));
         return random_point - o;
     }
+    // The sampled point is the crossing, so t = 1.
+    virtual vec3 sample_direction(const vec3& o, const vec3& n, float& pdf) const {
+        vec3 v = random(o);
+        float area = (x1-x0)*(z1-z0);
+        float distance_squared = v.length_squared();
+        float cosine = fabs(v.y() / v.length());
+        pdf = distance_squared / (cosine * area);
+        return v;
+    }
+    virtual double area() const { return (x1 - x0) * (z1 - z0); }
 public:
-    shared_ptr<material> mp;
-    double x0, x1, z0, z1, k;
+    material* mp;
+    real x0, x1, z0, z1, k;
 };
 
-class yz_rect : public hittable {
+class yz_rect final : public hittable {
 public:
     yz_rect() {}
 
-    yz_rect(double _y0, double _y1, double _z0, double _z1, double _k, shared_ptr<material> mat)
+    yz_rect(double _y0, double _y1, double _z0, double _z1, double _k, material* mat)
         : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
     virtual bool hit(const ray& r, double t0, double t1, hit_record& rec) const;
+    bool intersect(const ray& r, double t0, double t1, real& t) const;
+    virtual void surface(const ray& r, real t, hit_record& rec) const;
+    virtual bool deferred_hit(const ray& r, double t0, double t1, real& t, hit_record& rec) const {
+        return intersect(r, t0, t1, t);
+    }
+    virtual bool occluded(const ray& r, double t0, double t1) const {
+        auto t = (k - r.origin().x()) / r.direction().x();
+        if (!(t > t0 && t < t1))
+            return false;
+        auto y = r.origin().y() + t * r.direction().y();
+        auto z = r.origin().z() + t * r.direction().z();
+        return y >= y0 && y <= y1 && z >= z0 && z <= z1;
+    }
 
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const {
         output_box = aabb(vec3(k - 0.0001, y0, z0), vec3(k + 0.0001, y1, z1));
@@ -84,17 +149,21 @@ public:
     }
 
 public:
-    shared_ptr<material> mp;
-    double y0, y1, z0, z1, k;
+    material* mp;
+    real y0, y1, z0, z1, k;
 };
-bool xz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
-    auto t = (k - r.origin().y()) / r.direction().y();
+bool xz_rect::intersect(const ray& r, double t0, double t1, real& t) const {
+    t = (k - r.origin().y()) / r.direction().y();
     if (t < t0 || t > t1)
         return false;
     auto x = r.origin().x() + t * r.direction().x();
     auto z = r.origin().z() + t * r.direction().z();
-    if (x < x0 || x > x1 || z < z0 || z > z1)
-        return false;
+    return !(x < x0 || x > x1 || z < z0 || z > z1);
+}
+
+void xz_rect::surface(const ray& r, real t, hit_record& rec) const {
+    auto x = r.origin().x() + t * r.direction().x();
+    auto z = r.origin().z() + t * r.direction().z();
     rec.u = (x - x0) / (x1 - x0);
     rec.v = (z - z0) / (z1 - z0);
     rec.t = t;
@@ -102,17 +171,28 @@ bool xz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
     rec.hittedPoint = r.at(t);
+}
+
+bool xz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
+    real t;
+    if (!intersect(r, t0, t1, t))
+        return false;
+    surface(r, t, rec);
     return true;
 }
 
-bool yz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
-    auto t = (k - r.origin().x()) / r.direction().x();
+bool yz_rect::intersect(const ray& r, double t0, double t1, real& t) const {
+    t = (k - r.origin().x()) / r.direction().x();
     if (t < t0 || t > t1)
         return false;
     auto y = r.origin().y() + t * r.direction().y();
     auto z = r.origin().z() + t * r.direction().z();
-    if (y < y0 || y > y1 || z < z0 || z > z1)
-        return false;
+    return !(y < y0 || y > y1 || z < z0 || z > z1);
+}
+
+void yz_rect::surface(const ray& r, real t, hit_record& rec) const {
+    auto y = r.origin().y() + t * r.direction().y();
+    auto z = r.origin().z() + t * r.direction().z();
     rec.u = (y - y0) / (y1 - y0);
     rec.v = (z - z0) / (z1 - z0);
     rec.t = t;
@@ -120,5 +200,12 @@ bool yz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
     rec.hittedPoint = r.at(t);
+}
+
+bool yz_rect::hit(const ray& r, double t0, double t1, hit_record& rec) const {
+    real t;
+    if (!intersect(r, t0, t1, t))
+        return false;
+    surface(r, t, rec);
     return true;
 }
\ No newline at end of file
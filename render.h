@@ -0,0 +1,74 @@
+#pragma once
+#include "framebuffer.h"
+#include "thread_pool.h"
+#include "vec3.h"
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+struct render_options {
+    int image_width = 1280;
+    int image_height = 720;
+    int samples_per_pixel = 5;
+    int max_depth = 10;
+    int rr_start_depth = 3;     // bounces before Russian roulette kicks in
+    vec3 background = vec3(0, 0, 0);
+    int tile_size = 32;
+    std::string output;         // empty writes binary PPM to stdout
+    unsigned threads = 0;   // 0 picks std::thread::hardware_concurrency()
+    uint64_t seed = 0;
+    int packet_size = 0;        // 4 or 8 traces primary rays in NxN packets
+    bool wavefront = false;     // batch paths through per-stage passes
+    sampler_type sampler = sampler_independent;
+};
+
+// Starts the calling thread's sampler for sample s of pixel (i, j).
+inline void start_pixel_sample(int i, int j, int s, const render_options& opt) {
+    if (opt.sampler == sampler_blue_noise)
+        thread_sampler().start_blue_noise(i, j, s, opt.seed,
+            std::max(opt.image_width, opt.image_height), opt.samples_per_pixel);
+    else
+        seed_random(uint64_t(j) * opt.image_width + i, s, opt.seed, opt.sampler, opt.samples_per_pixel);
+}
+
+// Splits the frame into tiles and hands them to shade_tile(x0, y0, x1, y1)
+// on the pool, covering pixels [x0, x1) x [y0, y1). Tiles own disjoint
+// pixels, so the shared framebuffer is written without locking.
+template <typename TileFn>
+inline void for_each_tile(thread_pool& pool, const render_options& opt,
+    framebuffer& fb, TileFn shade_tile) {
+    const int width = opt.image_width;
+    const int height = opt.image_height;
+    const int tile = opt.tile_size;
+    const int tiles_x = (width + tile - 1) / tile;
+    const int tiles_y = (height + tile - 1) / tile;
+    const size_t tile_count = size_t(tiles_x) * tiles_y;
+
+    fb.resize(width, height);
+    std::atomic<size_t> tiles_done(0);
+    std::mutex progress_mutex;
+
+    pool.parallel_for(tile_count, [&](size_t t) {
+        int x0 = int(t % tiles_x) * tile;
+        int y0 = int(t / tiles_x) * tile;
+        shade_tile(x0, y0, std::min(x0 + tile, width), std::min(y0 + tile, height));
+
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        size_t done = ++tiles_done;
+        std::cerr << "\rTiles remaining: " << tile_count - done << ' ' << std::flush;
+    });
+}
+
+// shade_pixel(i, j) returns the summed radiance of pixel (i, j), with j = 0
+// at the bottom row as in camera::get_ray.
+template <typename PixelFn>
+inline void render_tiles(thread_pool& pool, const render_options& opt,
+    framebuffer& fb, PixelFn shade_pixel) {
+    for_each_tile(pool, opt, fb, [&](int x0, int y0, int x1, int y1) {
+        for (int j = y0; j < y1; j++)
+            for (int i = x0; i < x1; i++)
+                fb.set(i, j, shade_pixel(i, j));
+    });
+}
@@ -1,10 +1,13 @@
 #ifndef RTWEEKEND_H
 #define RTWEEKEND_H
 
+#include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
+#include "sobol.h"
 // Usings
 
 using std::shared_ptr;
@@ -24,8 +27,196 @@ inline double degrees_to_radians(double degrees) {
 inline double ffmin(double a, double b) { return a <= b ? a : b; }
 inline double ffmax(double a, double b) { return a >= b ? a : b; }
 
+// PCG32 (O'Neill, pcg-random.org): 64-bit LCG state with a permuted
+// 32-bit output. Small, fast and statistically much better than rand().
+class pcg32 {
+public:
+    pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+    pcg32(uint64_t initstate, uint64_t initseq) { seed(initstate, initseq); }
+
+    void seed(uint64_t initstate, uint64_t initseq) {
+        state = 0;
+        inc = (initseq << 1) | 1;
+        next_uint();
+        state += initstate;
+        next_uint();
+    }
+
+    uint32_t next_uint() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+        uint32_t rot = uint32_t(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+    // Uniform integer in [0, n) without modulo bias (Lemire's method).
+    uint32_t bounded(uint32_t n) {
+        uint64_t m = uint64_t(next_uint()) * n;
+        uint32_t l = uint32_t(m);
+        if (l < n) {
+            uint32_t threshold = (0u - n) % n;
+            while (l < threshold) {
+                m = uint64_t(next_uint()) * n;
+                l = uint32_t(m);
+            }
+        }
+        return uint32_t(m >> 32);
+    }
+
+    // Uniform double in [0, 1).
+    double next_double() {
+        return next_uint() * (1.0 / 4294967296.0);
+    }
+
+private:
+    uint64_t state;
+    uint64_t inc;
+};
+
+// splitmix64 finalizer, used to turn structured keys into seeds.
+inline uint64_t mix_bits(uint64_t v) {
+    v ^= v >> 30;
+    v *= 0xbf58476d1ce4e5b9ULL;
+    v ^= v >> 27;
+    v *= 0x94d049bb133111ebULL;
+    v ^= v >> 31;
+    return v;
+}
+
+enum sampler_type {
+    sampler_independent,    // white noise from pcg32
+    sampler_sobol,          // scrambled Sobol points, see sobol.h
+    sampler_blue_noise      // Sobol points ordered across pixels
+};
+
+// Source of the values behind random_double(). The independent sampler
+// draws every value from its generator. The Sobol sampler hands out one
+// dimension after another of the current sample's point in a sequence
+// scrambled per pixel, so the samples of a pixel are stratified in each
+// dimension (pixel position, lens, time, light and bounce choices) and
+// converge faster than plain Monte Carlo. A sample's dimensions follow
+// the order in which values are asked for; the integrator moves to a fixed
+// range of dimensions at every bounce so that paths which draw different
+// numbers of values still line up. That only holds if no bounce draws more
+// than bounce_sample_dimensions values, so sampling routines use a fixed
+// number of values rather than rejection loops; debug builds assert it.
+//
+// The blue-noise sampler draws the samples of all pixels from one Sobol
+// sequence in scrambled Morton order (see blue_noise_index), so that the
+// errors of neighbouring pixels cancel and what remains is high-frequency
+// noise, which looks far smoother at 1-4 spp. Dimensions are taken in
+// pairs that share a sample index, as 2D Sobol points.
+const uint32_t camera_sample_dimensions = 6;    // pixel position, lens, time; even
+const uint32_t bounce_sample_dimensions = 8;
+
+class sampler {
+public:
+    // Starts sample `sample` of spp samples of a pixel. Depends only on the
+    // arguments, so a render is reproducible whichever thread shades the
+    // pixel.
+    void start(uint64_t pixel, uint64_t sample, uint64_t seed, sampler_type t, uint32_t spp = 1) {
+        uint64_t key = mix_bits(pixel + mix_bits(seed));
+        rng.seed(mix_bits(key + sample), pixel);
+        type = t;
+        pixel_seed = uint32_t(key);
+        index = uint32_t(sample);
+        log2_spp = 0;
+        while ((uint64_t(1) << log2_spp) < spp)
+            log2_spp++;
+        block = UINT32_MAX;
+        dimension = 0;
+        dimension_end = camera_sample_dimensions;
+    }
+
+    // Starts sample `sample` of pixel (x, y) for the blue-noise sampler.
+    // resolution is the larger image side and spp the samples per pixel.
+    void start_blue_noise(uint32_t x, uint32_t y, uint64_t sample, uint64_t seed,
+        uint32_t resolution, uint32_t spp) {
+        start(uint64_t(y) * resolution + x, sample, seed, sampler_blue_noise, spp);
+        pixel_seed = uint32_t(mix_bits(seed));
+        int log2_resolution = 0;
+        while ((1u << log2_resolution) < resolution)
+            log2_resolution++;
+        morton = (morton_2d(x, y) << log2_spp) | sample;
+        base4_digits = log2_resolution + (log2_spp + 1) / 2;
+        odd_spp = (log2_spp & 1) != 0;
+    }
+
+    // Moves to the dimensions reserved for bounce depth of the path.
+    void start_bounce(int depth) {
+        dimension = camera_sample_dimensions + uint32_t(depth) * bounce_sample_dimensions;
+        dimension_end = dimension + bounce_sample_dimensions;
+    }
+
+    double next_double() {
+        assert(dimension < dimension_end && "too many values drawn for one camera sample or bounce");
+        if (type == sampler_independent) {
+            dimension++;
+            return rng.next_double();
+        }
+        if (type == sampler_sobol) {
+            // Same as sobol_sample, with the shuffle kept for the block.
+            if (dimension / 4 != block) {
+                block = dimension / 4;
+                block_seed = hash_uint(hash_combine(pixel_seed, block));
+                shuffled = shuffle_index(index, log2_spp, block_seed);
+            }
+            return sobol_block_sample(shuffled, dimension++, block_seed) * (1.0 / 4294967296.0);
+        }
+        // sobol() takes 32-bit indices. Past 2^32 samples per image the
+        // bits above them select a scramble instead, so the image becomes
+        // tiles that are each blue noise and are decorrelated from one
+        // another, rather than tiles that repeat the same samples. Both
+        // dimensions of a pair share the index, so it is computed once.
+        if (dimension / 2 != block) {
+            block = dimension / 2;
+            const uint64_t i = blue_noise_index(morton, block, base4_digits, odd_spp);
+            block_seed = pixel_seed ^ hash_uint(uint32_t(i >> 32));
+            shuffled = uint32_t(i);
+        }
+        const uint32_t value = nested_uniform_scramble(sobol(shuffled, dimension & 1),
+            hash_uint(hash_combine(block_seed, dimension)));
+        dimension++;
+        return value * (1.0 / 4294967296.0);
+    }
+
+public:
+    pcg32 rng;
+    sampler_type type = sampler_independent;
+    uint32_t pixel_seed = 0;    // the image's seed for the blue-noise sampler
+    uint32_t index = 0;
+    int log2_spp = 0;
+    // Values shared by a block of dimensions (four for sobol, a pair for
+    // blue noise): the block, its seed and the sample's index into it.
+    uint32_t block = UINT32_MAX;
+    uint32_t block_seed = 0;
+    uint32_t shuffled = 0;
+    uint32_t dimension = 0;
+    uint32_t dimension_end = UINT32_MAX;    // end of the current camera or bounce range
+    uint64_t morton = 0;        // blue-noise sampler only
+    int base4_digits = 0;
+    bool odd_spp = false;
+};
+
+// Every thread draws from its own sampler, so sampling needs no locks.
+inline sampler& thread_sampler() {
+    thread_local sampler s;
+    return s;
+}
+
+inline pcg32& thread_rng() {
+    return thread_sampler().rng;
+}
+
+// Restarts the calling thread's sampler for one camera sample.
+inline void seed_random(uint64_t pixel, uint64_t sample, uint64_t seed = 0,
+    sampler_type type = sampler_independent, uint32_t spp = 1) {
+    thread_sampler().start(pixel, sample, seed, type, spp);
+}
+
 inline double random_double() {
-    return rand() / (RAND_MAX + 1.0);
+    return thread_sampler().next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -33,8 +224,8 @@ inline double random_double(double min, double max) {
     return min + (max - min) * random_double();
 }
 inline int random_int(int min, int max) {
-
-    return (min + (max - min) * random_double())+0.5;
+    // Returns a random integer in [min,max].
+    return min + int(thread_rng().bounded(uint32_t(max - min + 1)));
 }
 inline double clamp(double x, double min, double max) {
     if (x < min) return min;
@@ -0,0 +1,152 @@
+#pragma once
+#include <cstdint>
+
+// Owen-scrambled Sobol points with hash-based scrambling and shuffling
+// (Burley, "Practical Hash-based Owen Scrambling", JCGT 2020). Dimensions
+// are served in blocks of four from the first four Sobol dimensions, each
+// block with its own seed; the first two dimensions of a block form a
+// (0,2)-sequence, so any power-of-two prefix of the samples of a pixel is
+// stratified like a progressive multi-jittered (PMJ02) set.
+
+inline uint32_t hash_uint(uint32_t x) {
+    x ^= x >> 17;
+    x *= 0xed5ad4bbu;
+    x ^= x >> 11;
+    x *= 0xac4c1b51u;
+    x ^= x >> 15;
+    x *= 0x31848babu;
+    x ^= x >> 14;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return seed ^ (v + (seed << 6) + (seed >> 2));
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Random permutation of x in which each bit depends only on the bits
+// below it (Laine and Karras); applied to reversed bits it becomes a nested
+// uniform (Owen) scramble.
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// Generator matrices of Sobol dimensions 0 to 3, from the Joe-Kuo
+// primitive polynomials and initial direction numbers.
+struct sobol_matrices {
+    uint32_t v[4][32];
+
+    sobol_matrices() {
+        const uint32_t degree[4] = { 0, 1, 2, 3 };
+        const uint32_t coefficients[4] = { 0, 0, 1, 1 };
+        const uint32_t initial[4][3] = { { 0 }, { 1 }, { 1, 3 }, { 1, 3, 1 } };
+        for (int k = 0; k < 32; k++)
+            v[0][k] = 1u << (31 - k);
+        for (int d = 1; d < 4; d++) {
+            const uint32_t s = degree[d];
+            for (uint32_t k = 0; k < 32; k++) {
+                if (k < s) {
+                    v[d][k] = initial[d][k] << (31 - k);
+                    continue;
+                }
+                uint32_t x = v[d][k - s] ^ (v[d][k - s] >> s);
+                for (uint32_t j = 1; j < s; j++)
+                    if ((coefficients[d] >> (s - 1 - j)) & 1)
+                        x ^= v[d][k - j];
+                v[d][k] = x;
+            }
+        }
+    }
+};
+
+// Runs once per significant bit of index, so small indices are cheap.
+inline uint32_t sobol(uint32_t index, int dim) {
+    static const sobol_matrices m;
+    uint32_t x = 0;
+    for (int k = 0; index; index >>= 1, k++)
+        x ^= m.v[dim][k] & (0u - (index & 1));
+    return x;
+}
+
+// Permutes each run of 2^log2_n consecutive indices among themselves by a
+// nested uniform scramble of their low bits, so shuffled indices stay as
+// small as the originals.
+inline uint32_t shuffle_index(uint32_t index, int log2_n, uint32_t seed) {
+    if (log2_n == 0)
+        return index;
+    const uint32_t high = log2_n < 32 ? index >> log2_n << log2_n : 0;
+    return high | (nested_uniform_scramble(index << (32 - log2_n), seed) >> (32 - log2_n));
+}
+
+// Dimension dim of a sample whose index was shuffled by the seed of dim's
+// block of four, as a 32-bit fixed-point fraction.
+inline uint32_t sobol_block_sample(uint32_t shuffled, uint32_t dim, uint32_t block_seed) {
+    return nested_uniform_scramble(sobol(shuffled, dim % 4), hash_combine(block_seed, dim % 4));
+}
+
+// Dimension dim of sample index in the sequence keyed by seed. The index is
+// shuffled within the pixel's 2^log2_spp samples so that every block of
+// dimensions uses a different ordering.
+inline uint32_t sobol_sample(uint32_t index, uint32_t dim, uint32_t seed, int log2_spp) {
+    const uint32_t block_seed = hash_uint(hash_combine(seed, dim / 4));
+    return sobol_block_sample(shuffle_index(index, log2_spp, block_seed), dim, block_seed);
+}
+
+// Interleaves the bits of x and y (x in the even bits).
+inline uint64_t morton_2d(uint32_t x, uint32_t y) {
+    uint64_t code = 0;
+    for (int b = 0; b < 32; b++)
+        code |= (uint64_t((x >> b) & 1) << (2 * b)) | (uint64_t((y >> b) & 1) << (2 * b + 1));
+    return code;
+}
+
+// Blue-noise ordering of pixel samples (Ahmed and Wonka, "Screen-Space
+// Blue-Noise Diffusion of Monte Carlo Sampling Error via Hierarchical
+// Ordering of Pixels", 2020; as in pbrt-v4's ZSobolSampler). The samples
+// of all pixels are consecutive indices of one scrambled sequence, taken
+// in Morton order, so each 2^k x 2^k block of pixels shares a stratified
+// set of points and neighbouring pixels get complementary strata. Each
+// base-4 digit of the Morton index is permuted by a hash of the digits
+// above it and of the dimension, which hides the curve's structure.
+//
+// morton is morton_2d(x, y) << log2_spp | sample, digits the number of
+// base-4 digits in it, and odd_spp whether log2_spp is odd.
+inline uint64_t blue_noise_index(uint64_t morton, uint32_t dimension, int digits, bool odd_spp) {
+    static const uint8_t permutations[24][4] = {
+        { 0, 1, 2, 3 }, { 0, 1, 3, 2 }, { 0, 2, 1, 3 }, { 0, 2, 3, 1 }, { 0, 3, 2, 1 }, { 0, 3, 1, 2 },
+        { 1, 0, 2, 3 }, { 1, 0, 3, 2 }, { 1, 2, 0, 3 }, { 1, 2, 3, 0 }, { 1, 3, 2, 0 }, { 1, 3, 0, 2 },
+        { 2, 1, 0, 3 }, { 2, 1, 3, 0 }, { 2, 0, 1, 3 }, { 2, 0, 3, 1 }, { 2, 3, 0, 1 }, { 2, 3, 1, 0 },
+        { 3, 1, 2, 0 }, { 3, 1, 0, 2 }, { 3, 2, 1, 0 }, { 3, 2, 0, 1 }, { 3, 0, 2, 1 }, { 3, 0, 1, 2 }
+    };
+    uint64_t index = 0;
+    const int last = odd_spp ? 1 : 0;
+    for (int i = digits - 1; i >= last; i--) {
+        const int shift = 2 * i - last;
+        const uint64_t digit = (morton >> shift) & 3;
+        const uint64_t higher = morton >> (shift + 2);
+        const uint32_t p = uint32_t((hash_uint(uint32_t(higher ^ (higher >> 32)) ^ (0x55555555u * dimension)) >> 24) % 24);
+        index |= uint64_t(permutations[p][digit]) << shift;
+    }
+    if (odd_spp) {
+        const uint64_t higher = morton >> 1;
+        index |= (morton & 1) ^ (hash_uint(uint32_t(higher ^ (higher >> 32)) ^ (0x55555555u * dimension)) & 1);
+    }
+    return index;
+}
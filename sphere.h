@@ -4,38 +4,67 @@
  
 #include "hittable.h"
 #include "vec3.h"
-void get_sphere_uv(const vec3& p, double& u, double& v) {
+void get_sphere_uv(const vec3& p, real& u, real& v) {
     auto phi = atan2(p.z(), p.x());
     auto theta = asin(p.y());
     u = 1 - (phi + pi) / (2 * pi);
     v = (theta + pi / 2) / pi;
 }
-class sphere : public hittable {
+// True if the ray r(t) = o + t*d meets the sphere for some t in
+// (t_min, t_max); shared by the occlusion queries of both sphere types.
+inline bool sphere_occludes(const vec3& oc, const vec3& d, double radius, double t_min, double t_max) {
+    auto a = d.length_squared();
+    auto half_b = dot(oc, d);
+    auto c = oc.length_squared() - radius * radius;
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant <= 0)
+        return false;
+    auto root = sqrt(discriminant);
+    auto t0 = (-half_b - root) / a;
+    auto t1 = (-half_b + root) / a;
+    return (t0 < t_max && t0 > t_min) || (t1 < t_max && t1 > t_min);
+}
+class sphere final : public hittable {
 public:
     sphere() { center = vec3(); radius = 0; }
-     sphere(vec3 cen, double r, shared_ptr<material> m)
+     sphere(vec3 cen, double r, material* m)
          : center(cen), radius(r),mat_ptr(m) {};
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+    bool intersect(const ray& r, double t_min, double t_max, real& t) const;
+    virtual void surface(const ray& r, real t, hit_record& rec) const;
+    virtual bool deferred_hit(const ray& r, double t_min, double t_max, real& t, hit_record& rec) const {
+        return intersect(r, t_min, t_max, t);
+    }
+    virtual bool occluded(const ray& r, double t_min, double t_max) const {
+        return sphere_occludes(r.origin() - center, r.direction(), radius, t_min, t_max);
+    }
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
     virtual float pdf_value(const vec3& o, const vec3& v) const;
     virtual vec3 random(const vec3& o) const;
+    virtual vec3 sample_direction(const vec3& o, const vec3& n, float& pdf) const;
+    virtual double area() const { return 4 * pi * radius * radius; }
 public:
     vec3 center;
-    double radius;
-    shared_ptr<material> mat_ptr;
+    real radius;
+    material* mat_ptr;
 };
-    float sphere::pdf_value(const vec3& o, const vec3& v)const {
-        hit_record rec;
-        if (this->hit(ray(o, v), 0.001, infinity, rec)) {
-        float cos_theta_max = sqrt(1 - radius*radius/(center - o).length_squared());
-        float solid_angle = 2 * pi * (1 - cos_theta_max);
-        return 1 / solid_angle;
-        }
-        else
-        {
-            return 0;
-        }
+// Uniform over the cone of directions from o that meet the sphere; v is
+// inside the cone when its angle to the centre is below theta_max, give or
+// take a few ulps so that directions sample_direction drew at the rim are
+// not rounded out of a narrow cone. Points inside the sphere have no such
+// cone and get 0.
+float sphere::pdf_value(const vec3& o, const vec3& v) const {
+    const real slack = 1 - 4 * std::numeric_limits<real>::epsilon();
+    vec3 direction = center - o;
+    float distance_squared = direction.length_squared();
+    if (distance_squared <= radius * radius)
+        return 0;
+    float cos_theta_max = sqrt(1 - radius*radius/distance_squared);
+    if (dot(v, direction) < cos_theta_max * v.length() * sqrt(distance_squared) * slack)
+        return 0;
+    float solid_angle = 2 * pi * (1 - cos_theta_max);
+    return 1 / solid_angle;
 }
     vec3 sphere::random(const vec3& o) const {
         vec3 direction = center - o;
@@ -44,7 +73,20 @@ public:
         uvw.build_from_w(direction);
         return uvw.local(random_to_sphere(radius,distance_squared));
     }
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+vec3 sphere::sample_direction(const vec3& o, const vec3& n, float& pdf) const {
+    vec3 direction = center - o;
+    float distance_squared = direction.length_squared();
+    if (distance_squared <= radius * radius) {
+        pdf = 0;
+        return direction;
+    }
+    float cos_theta_max = sqrt(1 - radius*radius/distance_squared);
+    pdf = 1 / (2 * pi * (1 - cos_theta_max));
+    return random(o);
+}
+// Closest root in [t_min, t_max]. Only t is computed; surface() fills in
+// the rest of the hit record, so traversal can defer it to the final hit.
+bool sphere::intersect(const ray& r, double t_min, double t_max, real& t) const {
     vec3 co = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(r.direction(), co);
@@ -52,59 +94,69 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     auto discriminant = half_b * half_b - a * c;
     if (discriminant > 0) {
         auto root = sqrt(discriminant);
-        auto temp = (-half_b - root) / a;
-        if (temp <= t_max && temp >= t_min) {
-            rec.t = temp;
-            rec.hittedPoint = r.at(temp);
-            vec3 outward_normal = (rec.hittedPoint - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
-            get_sphere_uv((rec.hittedPoint - center) / radius, rec.u, rec.v);
+        t = (-half_b - root) / a;
+        if (t <= t_max && t >= t_min)
             return true;
-        }
-        temp = (-half_b + root) / a;
-        if (temp <= t_max && temp >= t_min) {
-            rec.t = temp;
-            rec.hittedPoint = r.at(rec.t);
-            vec3 outward_normal = (rec.hittedPoint - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
-             get_sphere_uv((rec.hittedPoint - center) / radius, rec.u, rec.v);
+        t = (-half_b + root) / a;
+        if (t <= t_max && t >= t_min)
             return true;
-        }
     }
     return false;
 }
+
+void sphere::surface(const ray& r, real t, hit_record& rec) const {
+    rec.t = t;
+    rec.hittedPoint = r.at(t);
+    vec3 outward_normal = (rec.hittedPoint - center) / radius;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr;
+    get_sphere_uv((rec.hittedPoint - center) / radius, rec.u, rec.v);
+}
+
+bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    real t;
+    if (!intersect(r, t_min, t_max, t))
+        return false;
+    surface(r, t, rec);
+    return true;
+}
 bool sphere::bounding_box(double t0, double t1, aabb& output_box) const {
     output_box = aabb(
         center - vec3(radius, radius, radius),
         center + vec3(radius, radius, radius));
     return true;
 }
-class moving_sphere : public hittable {
+class moving_sphere final : public hittable {
 public:
     moving_sphere() {}
     moving_sphere(
-        vec3 cen0, vec3 cen1, double t0, double t1, double r, shared_ptr<material> m)
+        vec3 cen0, vec3 cen1, double t0, double t1, double r, material* m)
         : center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m)
     {};
 
     virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+    bool intersect(const ray& r, double t_min, double t_max, real& t) const;
+    virtual void surface(const ray& r, real t, hit_record& rec) const;
+    virtual bool deferred_hit(const ray& r, double t_min, double t_max, real& t, hit_record& rec) const {
+        return intersect(r, t_min, t_max, t);
+    }
+    virtual bool occluded(const ray& r, double t_min, double t_max) const {
+        return sphere_occludes(r.origin() - center(r.time()), r.direction(), radius, t_min, t_max);
+    }
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const;
     vec3 center(double time) const;
 
 public:
     vec3 center0, center1;
-    double time0, time1;
-    double radius;
-    shared_ptr<material> mat_ptr;
+    real time0, time1;
+    real radius;
+    material* mat_ptr;
 };
 
 vec3 moving_sphere::center(double time) const {
     return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 }
-bool moving_sphere::hit(
-    const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool moving_sphere::intersect(const ray& r, double t_min, double t_max, real& t) const {
     vec3 oc = r.origin() - center(r.time());
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -115,30 +167,34 @@ bool moving_sphere::hit(
     if (discriminant > 0) {
         auto root = sqrt(discriminant);
 
-        auto temp = (-half_b - root) / a;
-        if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.hittedPoint = r.at(rec.t);
-            vec3 outward_normal = (rec.hittedPoint - center(r.time())) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
-            get_sphere_uv((rec.hittedPoint - center(r.time())) / radius, rec.u, rec.v);
+        t = (-half_b - root) / a;
+        if (t < t_max && t > t_min)
             return true;
-        }
 
-        temp = (-half_b + root) / a;
-        if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.hittedPoint = r.at(rec.t);
-            vec3 outward_normal = (rec.hittedPoint - center(r.time())) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
-            get_sphere_uv((rec.hittedPoint - center(r.time())) / radius, rec.u, rec.v);
+        t = (-half_b + root) / a;
+        if (t < t_max && t > t_min)
             return true;
-        }
     }
     return false;
 }
+
+void moving_sphere::surface(const ray& r, real t, hit_record& rec) const {
+    rec.t = t;
+    rec.hittedPoint = r.at(rec.t);
+    vec3 outward_normal = (rec.hittedPoint - center(r.time())) / radius;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr;
+    get_sphere_uv((rec.hittedPoint - center(r.time())) / radius, rec.u, rec.v);
+}
+
+bool moving_sphere::hit(
+    const ray& r, double t_min, double t_max, hit_record& rec) const {
+    real t;
+    if (!intersect(r, t_min, t_max, t))
+        return false;
+    surface(r, t, rec);
+    return true;
+}
 bool moving_sphere::bounding_box(double t0, double t1, aabb& output_box) const {
     aabb box0(
         center(t0) - vec3(radius, radius, radius),
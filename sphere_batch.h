@@ -0,0 +1,228 @@
+#pragma once
+#include "sphere.h"
+#include <cstdint>
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+const int sphere_batch_width = 4;
+
+// Up to four spheres, static or moving, stored structure-of-arrays so that
+// one pass of SIMD arithmetic intersects all of them. A static sphere is a
+// moving one whose centre does not move, which keeps the lanes uniform.
+// Used as a multi-primitive BVH leaf.
+struct alignas(32) sphere_batch {
+    real cx[sphere_batch_width], cy[sphere_batch_width], cz[sphere_batch_width];
+    real mx[sphere_batch_width], my[sphere_batch_width], mz[sphere_batch_width];   // center1 - center0
+    real time0[sphere_batch_width], duration[sphere_batch_width];
+    real radius[sphere_batch_width];
+    material* mat_ptr[sphere_batch_width];
+    bool closed[sphere_batch_width];   // sphere lanes accept t_min and t_max themselves
+    int count = 0;
+
+    void add(const sphere& s) {
+        set_lane(s.center, s.center, 0, 1, s.radius, s.mat_ptr, true);
+    }
+    void add(const moving_sphere& s) {
+        set_lane(s.center0, s.center1, s.time0, s.time1, s.radius, s.mat_ptr, false);
+    }
+
+    vec3 center(int k, double time) const {
+        return vec3(cx[k], cy[k], cz[k])
+            + ((time - time0[k]) / duration[k]) * vec3(mx[k], my[k], mz[k]);
+    }
+
+    // Same results as calling sphere::intersect or moving_sphere::intersect
+    // on each lane and keeping the closest; lane says which sphere won. The
+    // two differ only in whether a root exactly at t_min or t_max counts.
+    bool intersect(const ray& r, double t_min, double t_max, real& t, int& lane) const {
+        real near_t[sphere_batch_width], far_t[sphere_batch_width];
+        roots(r, near_t, far_t);
+        lane = -1;
+        for (int k = 0; k < count; k++) {
+            real tk = in_range(k, near_t[k], t_min, t_max) ? near_t[k] : far_t[k];
+            if (in_range(k, tk, t_min, t_max)) {
+                t_max = tk;
+                lane = k;
+            }
+        }
+        t = real(t_max);
+        return lane >= 0;
+    }
+
+    void surface(const ray& r, real t, int lane, hit_record& rec) const {
+        rec.t = t;
+        rec.hittedPoint = r.at(rec.t);
+        vec3 outward_normal = (rec.hittedPoint - center(lane, r.time())) / radius[lane];
+        rec.set_face_normal(r, outward_normal);
+        rec.mat_ptr = mat_ptr[lane];
+        get_sphere_uv(outward_normal, rec.u, rec.v);
+    }
+
+    bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+        real t;
+        int lane;
+        if (!intersect(r, t_min, t_max, t, lane))
+            return false;
+        surface(r, t, lane, rec);
+        return true;
+    }
+
+    bool occluded(const ray& r, double t_min, double t_max) const {
+        real near_t[sphere_batch_width], far_t[sphere_batch_width];
+        roots(r, near_t, far_t);
+        for (int k = 0; k < count; k++)
+            if ((near_t[k] < t_max && near_t[k] > t_min) || (far_t[k] < t_max && far_t[k] > t_min))
+                return true;
+        return false;
+    }
+
+    bool bounding_box(double t0, double t1, aabb& output_box) const {
+        output_box = aabb(vec3(infinity, infinity, infinity), vec3(-infinity, -infinity, -infinity));
+        for (int k = 0; k < count; k++) {
+            vec3 rad(radius[k], radius[k], radius[k]);
+            output_box = surrounding_box(output_box, aabb(center(k, t0) - rad, center(k, t0) + rad));
+            output_box = surrounding_box(output_box, aabb(center(k, t1) - rad, center(k, t1) + rad));
+        }
+        return true;
+    }
+
+private:
+    bool in_range(int k, real t, double t_min, double t_max) const {
+        return closed[k] ? t <= t_max && t >= t_min : t < t_max && t > t_min;
+    }
+
+    void set_lane(const vec3& c0, const vec3& c1, real t0, real t1, real r, material* m, bool c) {
+        int k = count++;
+        cx[k] = c0.x();
+        cy[k] = c0.y();
+        cz[k] = c0.z();
+        mx[k] = c1.x() - c0.x();
+        my[k] = c1.y() - c0.y();
+        mz[k] = c1.z() - c0.z();
+        time0[k] = t0;
+        duration[k] = t1 - t0;
+        radius[k] = r;
+        mat_ptr[k] = m;
+        closed[k] = c;
+        // Unused lanes hold a copy of lane 0; count masks them out.
+        for (int j = count; j < sphere_batch_width; j++) {
+            cx[j] = cx[0]; cy[j] = cy[0]; cz[j] = cz[0];
+            mx[j] = mx[0]; my[j] = my[0]; mz[j] = mz[0];
+            time0[j] = time0[0]; duration[j] = duration[0];
+            radius[j] = radius[0];
+            mat_ptr[j] = mat_ptr[0];
+            closed[j] = closed[0];
+        }
+    }
+
+    // Both roots of every lane's ray/sphere quadratic, or infinity where
+    // the ray misses. The arithmetic follows sphere::hit step for step so
+    // the roots match it exactly. Doubles take one AVX vector per batch, or
+    // two SSE2 vectors where AVX is not enabled.
+    void roots(const ray& r, real* near_t, real* far_t) const;
+};
+
+#if defined(__AVX__) && !defined(RT_SINGLE_PRECISION)
+inline void sphere_batch::roots(const ray& r, real* near_t, real* far_t) const {
+    const vec3& o = r.origin();
+    const vec3& d = r.direction();
+    __m256d s = _mm256_div_pd(_mm256_sub_pd(_mm256_set1_pd(r.time()), _mm256_load_pd(time0)),
+        _mm256_load_pd(duration));
+    __m256d ocx = _mm256_sub_pd(_mm256_set1_pd(o.x()), _mm256_add_pd(_mm256_load_pd(cx), _mm256_mul_pd(s, _mm256_load_pd(mx))));
+    __m256d ocy = _mm256_sub_pd(_mm256_set1_pd(o.y()), _mm256_add_pd(_mm256_load_pd(cy), _mm256_mul_pd(s, _mm256_load_pd(my))));
+    __m256d ocz = _mm256_sub_pd(_mm256_set1_pd(o.z()), _mm256_add_pd(_mm256_load_pd(cz), _mm256_mul_pd(s, _mm256_load_pd(mz))));
+    __m256d a = _mm256_set1_pd(d.length_squared());
+    __m256d half_b = _mm256_add_pd(_mm256_add_pd(
+        _mm256_mul_pd(_mm256_set1_pd(d.x()), ocx),
+        _mm256_mul_pd(_mm256_set1_pd(d.y()), ocy)),
+        _mm256_mul_pd(_mm256_set1_pd(d.z()), ocz));
+    __m256d rad = _mm256_load_pd(radius);
+    __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(
+        _mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)),
+        _mm256_mul_pd(rad, rad));
+    __m256d disc = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+    __m256d miss = _mm256_cmp_pd(disc, _mm256_setzero_pd(), _CMP_NGT_UQ);
+    __m256d root = _mm256_sqrt_pd(_mm256_max_pd(disc, _mm256_setzero_pd()));
+    __m256d neg_b = _mm256_xor_pd(half_b, _mm256_set1_pd(-0.0));
+    __m256d inf = _mm256_set1_pd(infinity);
+    _mm256_storeu_pd(near_t, _mm256_blendv_pd(_mm256_div_pd(_mm256_sub_pd(neg_b, root), a), inf, miss));
+    _mm256_storeu_pd(far_t, _mm256_blendv_pd(_mm256_div_pd(_mm256_add_pd(neg_b, root), a), inf, miss));
+}
+#elif defined(RT_SINGLE_PRECISION) && (defined(__SSE2__) || defined(_M_X64))
+inline void sphere_batch::roots(const ray& r, real* near_t, real* far_t) const {
+    const vec3& o = r.origin();
+    const vec3& d = r.direction();
+    __m128 s = _mm_div_ps(_mm_sub_ps(_mm_set1_ps(r.time()), _mm_load_ps(time0)), _mm_load_ps(duration));
+    __m128 ocx = _mm_sub_ps(_mm_set1_ps(o.x()), _mm_add_ps(_mm_load_ps(cx), _mm_mul_ps(s, _mm_load_ps(mx))));
+    __m128 ocy = _mm_sub_ps(_mm_set1_ps(o.y()), _mm_add_ps(_mm_load_ps(cy), _mm_mul_ps(s, _mm_load_ps(my))));
+    __m128 ocz = _mm_sub_ps(_mm_set1_ps(o.z()), _mm_add_ps(_mm_load_ps(cz), _mm_mul_ps(s, _mm_load_ps(mz))));
+    __m128 a = _mm_set1_ps(d.length_squared());
+    __m128 half_b = _mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(_mm_set1_ps(d.x()), ocx),
+        _mm_mul_ps(_mm_set1_ps(d.y()), ocy)),
+        _mm_mul_ps(_mm_set1_ps(d.z()), ocz));
+    __m128 rad = _mm_load_ps(radius);
+    __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+        _mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+        _mm_mul_ps(rad, rad));
+    __m128 disc = _mm_sub_ps(_mm_mul_ps(half_b, half_b), _mm_mul_ps(a, c));
+    __m128 hit = _mm_cmpgt_ps(disc, _mm_setzero_ps());
+    __m128 root = _mm_sqrt_ps(_mm_max_ps(disc, _mm_setzero_ps()));
+    __m128 neg_b = _mm_xor_ps(half_b, _mm_set1_ps(-0.0f));
+    __m128 inf = _mm_set1_ps(infinity);
+    __m128 t0 = _mm_div_ps(_mm_sub_ps(neg_b, root), a);
+    __m128 t1 = _mm_div_ps(_mm_add_ps(neg_b, root), a);
+    _mm_storeu_ps(near_t, _mm_or_ps(_mm_and_ps(hit, t0), _mm_andnot_ps(hit, inf)));
+    _mm_storeu_ps(far_t, _mm_or_ps(_mm_and_ps(hit, t1), _mm_andnot_ps(hit, inf)));
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+inline void sphere_batch::roots(const ray& r, real* near_t, real* far_t) const {
+    const vec3& o = r.origin();
+    const vec3& d = r.direction();
+    const __m128d time = _mm_set1_pd(r.time());
+    const __m128d ox = _mm_set1_pd(o.x()), oy = _mm_set1_pd(o.y()), oz = _mm_set1_pd(o.z());
+    const __m128d dx = _mm_set1_pd(d.x()), dy = _mm_set1_pd(d.y()), dz = _mm_set1_pd(d.z());
+    const __m128d a = _mm_set1_pd(d.length_squared());
+    const __m128d inf = _mm_set1_pd(infinity);
+    for (int k = 0; k < sphere_batch_width; k += 2) {
+        __m128d s = _mm_div_pd(_mm_sub_pd(time, _mm_load_pd(time0 + k)), _mm_load_pd(duration + k));
+        __m128d ocx = _mm_sub_pd(ox, _mm_add_pd(_mm_load_pd(cx + k), _mm_mul_pd(s, _mm_load_pd(mx + k))));
+        __m128d ocy = _mm_sub_pd(oy, _mm_add_pd(_mm_load_pd(cy + k), _mm_mul_pd(s, _mm_load_pd(my + k))));
+        __m128d ocz = _mm_sub_pd(oz, _mm_add_pd(_mm_load_pd(cz + k), _mm_mul_pd(s, _mm_load_pd(mz + k))));
+        __m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, ocx), _mm_mul_pd(dy, ocy)), _mm_mul_pd(dz, ocz));
+        __m128d rad = _mm_load_pd(radius + k);
+        __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(
+            _mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)),
+            _mm_mul_pd(rad, rad));
+        __m128d disc = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(a, c));
+        __m128d hit = _mm_cmpgt_pd(disc, _mm_setzero_pd());
+        __m128d root = _mm_sqrt_pd(_mm_max_pd(disc, _mm_setzero_pd()));
+        __m128d neg_b = _mm_xor_pd(half_b, _mm_set1_pd(-0.0));
+        __m128d t0 = _mm_div_pd(_mm_sub_pd(neg_b, root), a);
+        __m128d t1 = _mm_div_pd(_mm_add_pd(neg_b, root), a);
+        _mm_storeu_pd(near_t + k, _mm_or_pd(_mm_and_pd(hit, t0), _mm_andnot_pd(hit, inf)));
+        _mm_storeu_pd(far_t + k, _mm_or_pd(_mm_and_pd(hit, t1), _mm_andnot_pd(hit, inf)));
+    }
+}
+#else
+// Branch-free lane loop that the compiler can vectorize.
+inline void sphere_batch::roots(const ray& r, real* near_t, real* far_t) const {
+    const vec3& o = r.origin();
+    const vec3& d = r.direction();
+    const real a = d.length_squared();
+    const real time = r.time();
+    for (int k = 0; k < sphere_batch_width; k++) {
+        real s = (time - time0[k]) / duration[k];
+        real ocx = o.x() - (cx[k] + s * mx[k]);
+        real ocy = o.y() - (cy[k] + s * my[k]);
+        real ocz = o.z() - (cz[k] + s * mz[k]);
+        real half_b = d.x() * ocx + d.y() * ocy + d.z() * ocz;
+        real c = (ocx * ocx + ocy * ocy + ocz * ocz) - radius[k] * radius[k];
+        real disc = half_b * half_b - a * c;
+        real root = std::sqrt(disc > 0 ? disc : real(0));
+        near_t[k] = disc > 0 ? (-half_b - root) / a : real(infinity);
+        far_t[k] = disc > 0 ? (-half_b + root) / a : real(infinity);
+    }
+}
+#endif
@@ -0,0 +1,156 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent work-stealing pool. Each worker owns a deque: it pops its own
+// work from the back and steals from the front of the others when it runs
+// dry. The thread that waits on a task_group helps run tasks, so a pool of
+// size n keeps n threads busy with n - 1 workers.
+class thread_pool {
+public:
+    class task_group {
+    public:
+        task_group() : pending(0) {}
+    private:
+        friend class thread_pool;
+        std::atomic<size_t> pending;
+    };
+
+    explicit thread_pool(unsigned threads = 0) {
+        if (threads == 0)
+            threads = std::thread::hardware_concurrency();
+        if (threads == 0)
+            threads = 1;
+        for (unsigned i = 0; i < threads; i++)
+            queues.push_back(std::unique_ptr<work_queue>(new work_queue()));
+        for (unsigned i = 1; i < threads; i++)
+            workers.emplace_back([this, i] { worker_loop(i); });
+    }
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& w : workers)
+            w.join();
+    }
+
+    unsigned size() const { return (unsigned)queues.size(); }
+
+    void run(task_group& group, std::function<void()> fn) {
+        group.pending++;
+        int home = worker_index >= 0 ? worker_index : (int)(next_queue++ % queues.size());
+        push(home, task{ std::move(fn), &group });
+    }
+
+    void wait(task_group& group) {
+        int home = worker_index >= 0 ? worker_index : 0;
+        while (group.pending.load() != 0) {
+            if (!try_run_one(home))
+                std::this_thread::yield();
+        }
+    }
+
+    // Runs body(i) for every i in [0, count). Indices are dealt out in
+    // contiguous blocks so neighbouring items start on the same thread;
+    // stealing rebalances when some blocks turn out to be more expensive.
+    void parallel_for(size_t count, const std::function<void(size_t)>& body) {
+        task_group group;
+        size_t n = queues.size();
+        group.pending += count;
+        for (size_t q = 0; q < n; q++) {
+            size_t begin = count * q / n;
+            size_t end = count * (q + 1) / n;
+            if (begin == end)
+                continue;
+            {
+                std::lock_guard<std::mutex> lock(queues[q]->m);
+                for (size_t i = begin; i < end; i++)
+                    queues[q]->tasks.push_back(task{ [&body, i] { body(i); }, &group });
+            }
+            queued += end - begin;
+        }
+        notify();
+        wait(group);
+    }
+
+private:
+    struct task {
+        std::function<void()> fn;
+        task_group* group;
+    };
+    struct work_queue {
+        std::mutex m;
+        std::deque<task> tasks;
+    };
+
+    void push(int q, task t) {
+        {
+            std::lock_guard<std::mutex> lock(queues[q]->m);
+            queues[q]->tasks.push_back(std::move(t));
+        }
+        queued++;
+        notify();
+    }
+
+    void notify() {
+        { std::lock_guard<std::mutex> lock(sleep_mutex); }
+        wake.notify_all();
+    }
+
+    bool try_run_one(int home) {
+        task t;
+        size_t n = queues.size();
+        bool found = false;
+        for (size_t k = 0; k < n && !found; k++) {
+            work_queue& q = *queues[(home + k) % n];
+            std::lock_guard<std::mutex> lock(q.m);
+            if (q.tasks.empty())
+                continue;
+            if (k == 0) {
+                t = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            }
+            else {
+                t = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            found = true;
+        }
+        if (!found)
+            return false;
+        queued--;
+        t.fn();
+        t.group->pending--;
+        return true;
+    }
+
+    void worker_loop(int index) {
+        worker_index = index;
+        while (true) {
+            if (try_run_one(index))
+                continue;
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this] { return stop || queued.load() > 0; });
+            if (stop)
+                return;
+        }
+    }
+
+    std::vector<std::unique_ptr<work_queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::atomic<size_t> queued{ 0 };
+    std::atomic<size_t> next_queue{ 0 };
+    bool stop = false;
+    inline static thread_local int worker_index = -1;
+};
@@ -1,121 +1,228 @@
 #pragma once 
+#include "rtweekend.h"
 #include <iostream>
-class vec3 {
+#ifdef RT_USE_SSE
+#include <immintrin.h>
+#endif
+
+// Scalar type of the renderer's geometry, rays and colours, fixed at
+// compile time. Defining RT_SINGLE_PRECISION halves the size of every
+// vec3, ray, hit_record and BVH box; RT_USE_SSE additionally stores the
+// float vector in an SSE register (see the specialization below).
+#ifdef RT_SINGLE_PRECISION
+typedef float real;
+#else
+typedef double real;
+#endif
+
+template <typename T>
+class vec3t {
 public:
-	vec3() :e{ 0,0,0 } { };
-	vec3(double e0, double e1, double e2) :e{ e0,e1,e2 } {};
-	double x() const { return e[0]; }
-	double y() const { return e[1]; }
-	double z() const { return e[2]; }
-	double at(int x) const { return e[x]; }
-	vec3 operator -() const{
-		return vec3(-e[0],-e[1],-e[2]);
-	}
-	double operator[](int i) const { return e[i]; }
-	double& operator[](int i) { return e[i]; }
-
-	vec3& operator+=(const vec3& v) {
+	typedef T scalar;
+
+	vec3t() :e{ 0,0,0 } { };
+	vec3t(T e0, T e1, T e2) :e{ e0,e1,e2 } {};
+	T x() const { return e[0]; }
+	T y() const { return e[1]; }
+	T z() const { return e[2]; }
+	T at(int x) const { return e[x]; }
+	vec3t operator -() const{
+		return vec3t(-e[0],-e[1],-e[2]);
+	}
+	T operator[](int i) const { return e[i]; }
+	T& operator[](int i) { return e[i]; }
+
+	vec3t& operator+=(const vec3t& v) {
 		e[0] += v.x();
 		e[1] += v.y();
 		e[2] += v.z();
 		return *this;
 	}
-	vec3& operator*=(const double t) {
+	vec3t& operator*=(const T t) {
 		e[0] *= t;
 		e[1] *= t;
 		e[2] *= t;
 		return *this;
 	}
-	vec3& operator/=(const double t) {
+	vec3t& operator/=(const T t) {
 		e[0] /= t;
 		e[1] /= t;
 		e[2] /= t;
 		return *this;
 	}
-	double length_squared() const {
+	inline static vec3t random() {
+		return vec3t(T(random_double()), T(random_double()), T(random_double()));
+	}
+	inline static vec3t random(double min, double max) {
+		return vec3t(T(random_double(min, max)), T(random_double(min, max)), T(random_double(min, max)));
+	}
+	T length_squared() const {
 		return x() * x() + y() * y() + z() * z();
 
 	}
-	double length() const {
+	T length() const {
 		return sqrt(length_squared());
 	}
-	void write_color(std::ostream& out, int samples_per_pixel) {
-		double scale = 1.0 / samples_per_pixel;
-		double r = sqrt(scale * x());
-		double g = sqrt(scale * y());
-		double b = sqrt(scale * z());
-		// Write the translated [0,255] value of each color component.
-		out << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
-			<< static_cast<int>(256 * clamp(g, 0.0, 0.999)) << ' '
-			<< static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
-	}
-
 
 private:
-	double e[3];
+	T e[3];
 };
-inline std::ostream& operator<<(std::ostream& out, const vec3& v) {
+
+// The scalar argument of the mixed operators is a non-deduced context, so
+// double literals such as 0.5 * v still work with float vectors.
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const vec3t<T>& v) {
 	return out << v.x() << ' ' << v.y() << ' ' << v.z();
 }
 
-inline vec3 operator+(const vec3& u, const vec3& v) {
-	return vec3(u.x() + v.x(), u.y() + v.y(), u.z() + v.z());
+template <typename T>
+inline vec3t<T> operator+(const vec3t<T>& u, const vec3t<T>& v) {
+	return vec3t<T>(u.x() + v.x(), u.y() + v.y(), u.z() + v.z());
 }
-inline vec3 operator-(const vec3& u, const vec3& v) {
-	return vec3(u.x() - v.x(), u.y() - v.y(), u.z() - v.z());
+template <typename T>
+inline vec3t<T> operator-(const vec3t<T>& u, const vec3t<T>& v) {
+	return vec3t<T>(u.x() - v.x(), u.y() - v.y(), u.z() - v.z());
 }
 
-inline vec3 operator*(const vec3& u, const vec3& v) {
-	return vec3(u.x() * v.x(), u.y() * v.y(), u.z() * v.z());
+template <typename T>
+inline vec3t<T> operator*(const vec3t<T>& u, const vec3t<T>& v) {
+	return vec3t<T>(u.x() * v.x(), u.y() * v.y(), u.z() * v.z());
 }
 
-inline vec3 operator*(double t, const vec3& v) {
-	return vec3(t * v.x(), t * v.y(), t * v.z());
+template <typename T>
+inline vec3t<T> operator*(typename vec3t<T>::scalar t, const vec3t<T>& v) {
+	return vec3t<T>(t * v.x(), t * v.y(), t * v.z());
 }
 
-inline vec3 operator*(const vec3& v, double t) {
+template <typename T>
+inline vec3t<T> operator*(const vec3t<T>& v, typename vec3t<T>::scalar t) {
 	return t * v;
 }
 
-inline vec3 operator/(vec3 v, double t) {
+template <typename T>
+inline vec3t<T> operator/(vec3t<T> v, typename vec3t<T>::scalar t) {
 	return (1 / t) * v;
 }
 
-inline double dot(const vec3& u, const vec3& v) {
+template <typename T>
+inline T dot(const vec3t<T>& u, const vec3t<T>& v) {
 	return u.x() * v.x()
 		+ u.y() * v.y()
 		+ u.z() * v.z();
 }
 
-inline vec3 cross(const vec3& u, const vec3& v) {
-	return vec3(u.y() * v.z() - u.z() * v.y(),
+template <typename T>
+inline vec3t<T> cross(const vec3t<T>& u, const vec3t<T>& v) {
+	return vec3t<T>(u.y() * v.z() - u.z() * v.y(),
 		u.z() * v.x() - u.x() * v.z(),
 		u.x() * v.y() - u.y() * v.x());
 }
 
-inline vec3 unit_vector(vec3 v) {
+template <typename T>
+inline vec3t<T> unit_vector(vec3t<T> v) {
 	return v / v.length();
 }
-inline static vec3 random() {
-	return vec3(random_double(), random_double(), random_double());
-}
 
-inline static vec3 random(double min, double max) {
-	return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
-}
-vec3 random_in_unit_sphere() {
-	while (true) {
-		auto p = random(-1, 1);
-		if (p.length_squared() >= 1) continue;
-		return p;
+#ifdef RT_USE_SSE
+// Single-precision vector held in one SSE register; the fourth lane is
+// kept at zero so horizontal sums can include it.
+template <>
+class alignas(16) vec3t<float> {
+public:
+	typedef float scalar;
+
+	vec3t() : m(_mm_setzero_ps()) {}
+	vec3t(float e0, float e1, float e2) : m(_mm_set_ps(0, e2, e1, e0)) {}
+	explicit vec3t(__m128 v) : m(v) {}
+	float x() const { return _mm_cvtss_f32(m); }
+	float y() const { return e[1]; }
+	float z() const { return e[2]; }
+	float at(int x) const { return e[x]; }
+	vec3t operator -() const {
+		return vec3t(_mm_sub_ps(_mm_setzero_ps(), m));
+	}
+	float operator[](int i) const { return e[i]; }
+	float& operator[](int i) { return e[i]; }
+
+	vec3t& operator+=(const vec3t& v) {
+		m = _mm_add_ps(m, v.m);
+		return *this;
+	}
+	vec3t& operator*=(const float t) {
+		m = _mm_mul_ps(m, _mm_set1_ps(t));
+		return *this;
+	}
+	vec3t& operator/=(const float t) {
+		return *this *= 1 / t;
+	}
+	inline static vec3t random() {
+		return vec3t(float(random_double()), float(random_double()), float(random_double()));
 	}
+	inline static vec3t random(double min, double max) {
+		return vec3t(float(random_double(min, max)), float(random_double(min, max)), float(random_double(min, max)));
+	}
+	float length_squared() const {
+		__m128 sq = _mm_mul_ps(m, m);
+		__m128 sum = _mm_add_ss(sq, _mm_movehl_ps(sq, sq));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(1, 1, 1, 1)));
+		return _mm_cvtss_f32(sum);
+	}
+	float length() const {
+		return sqrt(length_squared());
+	}
+
+	union {
+		__m128 m;
+		float e[4];
+	};
+};
+
+inline vec3t<float> operator+(const vec3t<float>& u, const vec3t<float>& v) {
+	return vec3t<float>(_mm_add_ps(u.m, v.m));
+}
+inline vec3t<float> operator-(const vec3t<float>& u, const vec3t<float>& v) {
+	return vec3t<float>(_mm_sub_ps(u.m, v.m));
+}
+inline vec3t<float> operator*(const vec3t<float>& u, const vec3t<float>& v) {
+	return vec3t<float>(_mm_mul_ps(u.m, v.m));
 }
+inline vec3t<float> operator*(float t, const vec3t<float>& v) {
+	return vec3t<float>(_mm_mul_ps(_mm_set1_ps(t), v.m));
+}
+inline vec3t<float> operator*(const vec3t<float>& v, float t) {
+	return t * v;
+}
+inline vec3t<float> operator/(vec3t<float> v, float t) {
+	return (1 / t) * v;
+}
+inline float dot(const vec3t<float>& u, const vec3t<float>& v) {
+	__m128 p = _mm_mul_ps(u.m, v.m);
+	__m128 sum = _mm_add_ss(p, _mm_movehl_ps(p, p));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+	return _mm_cvtss_f32(sum);
+}
+inline vec3t<float> cross(const vec3t<float>& u, const vec3t<float>& v) {
+	__m128 u_yzx = _mm_shuffle_ps(u.m, u.m, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 v_yzx = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 0, 2, 1));
+	__m128 c = _mm_sub_ps(_mm_mul_ps(u.m, v_yzx), _mm_mul_ps(u_yzx, v.m));
+	return vec3t<float>(_mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1)));
+}
+#endif
+
+typedef vec3t<real> vec3;
+
 vec3 random_unit_vector() {
 	auto a = random_double(0, 2 * pi);
 	auto z = random_double(-1, 1);
 	auto r = sqrt(1 - z * z);
 	return vec3(r * cos(a), r * sin(a), z);
 }
+// Uniform in the unit ball from exactly three values: the cube root of the
+// first keeps the density even in volume.
+vec3 random_in_unit_sphere() {
+	auto r = std::cbrt(random_double());
+	return r * random_unit_vector();
+}
 vec3 reflect(const vec3& v, const vec3& n) {
 	return v - 2 * dot(v, n) * n;
 }
@@ -130,12 +237,24 @@ double schlick(double cosine, double ref_idx) {
 	r0 = r0 * r0;
 	return r0 + (1 - r0) * pow((1 - cosine), 5);
 }
+// Shirley-Chiu concentric map of the square onto the disk. It takes
+// exactly two values, unlike rejection sampling, so a low-discrepancy
+// sampler's dimensions stay aligned across samples.
 vec3 random_in_unit_disk() {
-	while (true) {
-		auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-		if (p.length_squared() >= 1) continue;
-		return p;
+	auto a = random_double(-1, 1);
+	auto b = random_double(-1, 1);
+	if (a == 0 && b == 0)
+		return vec3(0, 0, 0);
+	double r, phi;
+	if (fabs(a) > fabs(b)) {
+		r = a;
+		phi = (pi / 4) * (b / a);
+	}
+	else {
+		r = b;
+		phi = pi / 2 - (pi / 4) * (a / b);
 	}
+	return vec3(r * cos(phi), r * sin(phi), 0);
 }
 vec3 random_cosine_direction() {
 	auto r1 = random_double();
@@ -0,0 +1,214 @@
+#pragma once
+#include "camera.h"
+#include "hittable.h"
+#include "render.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Paths in flight per batch. A tile's samples are split into as many
+// batches as it takes to stay under this.
+const size_t wavefront_batch_size = 64 * 1024;
+
+// Wavefront path tracer. Instead of following one path to the end, a batch
+// of paths is advanced one bounce at a time through separate passes:
+// generate camera rays, intersect them all, sort the hits by material
+// kind, run one shading kernel per kind, and finally accumulate. Every
+// kernel works on hits of a single concrete material, so its code and data
+// stay in cache and its calls are resolved statically.
+//
+// There is no shadow-ray pass between shading and accumulation: like
+// ray_color, the kernels sample lights through the scattering mixture pdf
+// rather than by next-event estimation, so no shadow rays are cast.
+//
+// Path state is kept structure-of-arrays. Each path carries its own
+// sampler state, which is swapped into thread_sampler() around its work, so
+// the image matches the one ray_color produces.
+class wavefront_batch {
+public:
+    wavefront_batch(const hittable& world, hittable* lights, const render_options& opt)
+        : world(world), lights(lights), opt(opt) {}
+
+    // Renders pixels [x0, x1) x [y0, y1) into fb.
+    void render_tile(const camera& cam, framebuffer& fb, int x0, int y0, int x1, int y1) {
+        const int w = x1 - x0;
+        const size_t pixels = size_t(w) * (y1 - y0);
+        const int spp = opt.samples_per_pixel;
+        const int chunk = int(std::max<size_t>(1, std::min<size_t>(spp, wavefront_batch_size / pixels)));
+
+        color.assign(pixels, vec3(0, 0, 0));
+        for (int s0 = 0; s0 < spp; s0 += chunk) {
+            int s1 = std::min(s0 + chunk, spp);
+            generate(cam, x0, y0, w, pixels, s0, s1);
+            for (int depth = 0; depth < opt.max_depth && !active.empty(); depth++) {
+                intersect();
+                sort_by_material();
+                shade(depth);
+            }
+            accumulate();
+        }
+        for (size_t p = 0; p < pixels; p++)
+            fb.set(x0 + int(p % w), y0 + int(p / w), color[p]);
+    }
+
+private:
+    void resize(size_t n) {
+        origin.resize(n);
+        direction.resize(n);
+        time.resize(n);
+        throughput.resize(n);
+        radiance.resize(n);
+        rng.resize(n);
+        pixel.resize(n);
+        rec.resize(n);
+        hit.resize(n);
+    }
+
+    ray path_ray(uint32_t i) const { return ray(origin[i], direction[i], time[i]); }
+
+    void set_ray(uint32_t i, const ray& r) {
+        origin[i] = r.origin();
+        direction[i] = r.direction();
+        time[i] = r.time();
+    }
+
+    // Camera rays for samples [s0, s1) of every pixel, sample-minor so a
+    // pixel's samples sit next to each other.
+    void generate(const camera& cam, int x0, int y0, int w, size_t pixels, int s0, int s1) {
+        const size_t n = pixels * (s1 - s0);
+        resize(n);
+        active.resize(n);
+        for (size_t p = 0, k = 0; p < pixels; p++) {
+            int i = x0 + int(p % w), j = y0 + int(p / w);
+            for (int s = s0; s < s1; s++, k++) {
+                start_pixel_sample(i, j, s, opt);
+                auto x = (i + random_double()) / opt.image_width;
+                auto y = (j + random_double()) / opt.image_height;
+                set_ray(uint32_t(k), cam.get_ray(x, y));
+                rng[k] = thread_sampler();
+                throughput[k] = vec3(1, 1, 1);
+                radiance[k] = vec3(0, 0, 0);
+                pixel[k] = uint32_t(p);
+                active[k] = uint32_t(k);
+            }
+        }
+    }
+
+    void intersect() {
+        for (uint32_t i : active)
+            hit[i] = world.hit(path_ray(i), 0.001, infinity, rec[i]);
+    }
+
+    // Retires paths that escaped and counting-sorts the rest by material
+    // kind, keeping generation order within a kind.
+    void sort_by_material() {
+        size_t count[material_kind_count + 1] = {};
+        for (uint32_t i : active) {
+            if (!hit[i])
+                radiance[i] += throughput[i] * opt.background;
+            else
+                count[rec[i].mat_ptr->kind + 1]++;
+        }
+        for (int k = 0; k < material_kind_count; k++)
+            count[k + 1] += count[k];
+        std::copy(count, count + material_kind_count + 1, queue_start);
+
+        queue.resize(count[material_kind_count]);
+        for (uint32_t i : active)
+            if (hit[i])
+                queue[count[rec[i].mat_ptr->kind]++] = i;
+        active.clear();
+    }
+
+    void shade(int depth) {
+        shade_kind<material>(material_other, depth);
+        shade_kind<lambertian>(material_lambertian, depth);
+        shade_kind<metal>(material_metal, depth);
+        shade_kind<dielectric>(material_dielectric, depth);
+        shade_kind<diffuse_light>(material_diffuse_light, depth);
+        // Kernels append survivors kind by kind; restore path order so the
+        // next intersection pass walks memory front to back.
+        std::sort(active.begin(), active.end());
+    }
+
+    // Shading kernel for one material kind. M is the concrete (final)
+    // class, so emitted, scatter and scattering_pdf bind statically; the
+    // material_other queue goes through the virtual calls. Survivors are
+    // appended to the active list.
+    template <typename M>
+    void shade_kind(material_kind kind, int depth) {
+        sampler& g = thread_sampler();
+        for (size_t n = queue_start[kind]; n < queue_start[kind + 1]; n++) {
+            uint32_t i = queue[n];
+            M* m = static_cast<M*>(rec[i].mat_ptr);
+            hit_record& hrec = rec[i];
+            ray r = path_ray(i);
+            g = rng[i];
+            g.start_bounce(depth);
+
+            radiance[i] += throughput[i] * m->emitted(r, hrec, hrec.u, hrec.v, hrec.hittedPoint);
+
+            scatter_record srec;
+            bool alive = m->scatter(r, hrec, srec);
+            if (alive && srec.is_specular) {
+                throughput[i] = throughput[i] * srec.attenuation;
+                set_ray(i, srec.specular_ray);
+            }
+            else if (alive) {
+                hittable_pdf light_pdf(lights, hrec.hittedPoint, hrec.normal);
+                mixture_pdf p(&light_pdf, srec.pdf_ptr);
+                float pdf_val;
+                ray scattered = ray(hrec.hittedPoint, p.sample(pdf_val), r.time());
+                alive = pdf_val > 0;
+                if (alive) {
+                    throughput[i] = throughput[i] * srec.attenuation
+                        * m->scattering_pdf(r, hrec, scattered) / pdf_val;
+                    set_ray(i, scattered);
+                }
+            }
+
+            if (alive && depth + 1 >= opt.rr_start_depth) {
+                double q = ffmin(0.95, ffmax(throughput[i].x(), ffmax(throughput[i].y(), throughput[i].z())));
+                alive = random_double() < q;
+                if (alive)
+                    throughput[i] /= q;
+            }
+            rng[i] = g;
+            thread_arena().reset();
+            if (alive)
+                active.push_back(i);
+        }
+    }
+
+    void accumulate() {
+        for (size_t k = 0; k < pixel.size(); k++)
+            color[pixel[k]] += radiance[k];
+    }
+
+    const hittable& world;
+    hittable* lights;
+    const render_options& opt;
+
+    std::vector<vec3> origin;
+    std::vector<vec3> direction;
+    std::vector<real> time;
+    std::vector<vec3> throughput;
+    std::vector<vec3> radiance;
+    std::vector<sampler> rng;
+    std::vector<uint32_t> pixel;    // tile-relative pixel of each path
+    std::vector<hit_record> rec;
+    std::vector<uint8_t> hit;
+
+    std::vector<uint32_t> active;   // paths still bouncing
+    std::vector<uint32_t> queue;    // hits sorted by material kind
+    size_t queue_start[material_kind_count + 1];
+    std::vector<vec3> color;        // per-pixel sums for the tile
+};
+
+inline void render_wavefront(thread_pool& pool, const render_options& opt, framebuffer& fb,
+    const camera& cam, const hittable& world, hittable* lights) {
+    for_each_tile(pool, opt, fb, [&](int x0, int y0, int x1, int y1) {
+        wavefront_batch batch(world, lights, opt);
+        batch.render_tile(cam, fb, x0, y0, x1, y1);
+    });
+}